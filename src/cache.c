@@ -0,0 +1,234 @@
+/*
+Copyright © 2013-2014 Pierre Neidhardt
+See LICENSE file for copyright and license details.
+*/
+
+/*
+Layer cache.
+
+Layers are addressed by the key of the parameters their stage reads, see
+render(), so that a texture which only differs in its colors reuses its work
+layer, and one which only differs in its smoothing also reuses it. Entries are
+copies: a fetched layer belongs to the caller, and dropping an entry never
+invalidates a layer in use.
+
+On disk, a layer is a file named after its key in hexadecimal, with a header of
+CACHE_MAGIC and the width and height, followed by the values. Files are written
+under a temporary name and renamed, so that concurrent runs sharing a directory
+never read half a layer. The keys and the header are in the byte order of the
+host.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+
+/* Layers kept in memory at most, whatever their size. */
+#define CACHE_ENTRIES 16
+#define CACHE_MAGIC "PTGL"
+#define CACHE_HEADER_SIZE (4 + 2 * sizeof (tsize_t))
+
+typedef struct {
+	Uint64 key;
+	Uint8 *v;
+	tsize_t width;
+	tsize_t height;
+	/* Clock of the last use. */
+	unsigned long used;
+} cache_entry;
+
+struct layer_cache {
+	cache_entry entries[CACHE_ENTRIES];
+	tarea_t budget;
+	tarea_t size;
+	unsigned long clock;
+	const char *directory;
+};
+
+/* FNV-1a. */
+Uint64 cache_key(Uint64 key, const void *data, unsigned long size) {
+	const Uint8 *bytes = data;
+	unsigned long i;
+	for (i = 0; i < size; i++) {
+		key ^= bytes[i];
+		key *= 0x100000001b3ull;
+	}
+	return key;
+}
+
+layer_cache *layer_cache_create(tarea_t budget, const char *directory) {
+	layer_cache *c = calloc(1, sizeof *c);
+	if (!c) {
+		return NULL;
+	}
+	c->budget = budget;
+	c->directory = directory;
+
+	if (directory && mkdir(directory, 0755) == -1 && errno != EEXIST) {
+		perror(directory);
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+void layer_cache_destroy(layer_cache *c) {
+	unsigned int i;
+	if (!c) {
+		return;
+	}
+	for (i = 0; i < CACHE_ENTRIES; i++) {
+		free(c->entries[i].v);
+	}
+	free(c);
+}
+
+static void cache_file(char *buf, const layer_cache *c, Uint64 key,
+	const char *suffix) {
+	snprintf(buf, FILENAME_MAX, "%s/%016llx%s", c->directory,
+		(unsigned long long)key, suffix);
+}
+
+/* Transfer all of 'size' bytes, 'out' tells the direction. */
+static int cache_io(int fd, void *buf, tarea_t size, int out) {
+	tarea_t done = 0;
+	while (done < size) {
+		ssize_t n = out ? write(fd, (Uint8 *)buf + done, size - done) :
+			read(fd, (Uint8 *)buf + done, size - done);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return EXIT_FAILURE;
+		}
+		done += n;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Keep a copy of 'l' in memory, dropping the least recently used layers. */
+static void cache_keep(layer_cache *c, Uint64 key, const layer *l) {
+	tarea_t size = (tarea_t)l->width * l->height;
+	unsigned int i;
+
+	if (size > c->budget) {
+		return;
+	}
+
+	for (;;) {
+		cache_entry *oldest = NULL, *free_entry = NULL;
+		for (i = 0; i < CACHE_ENTRIES; i++) {
+			cache_entry *e = &c->entries[i];
+			if (!e->v) {
+				free_entry = e;
+			} else if (!oldest || e->used < oldest->used) {
+				oldest = e;
+			}
+		}
+
+		if (free_entry && c->size + size <= c->budget) {
+			free_entry->v = malloc(size);
+			if (!free_entry->v) {
+				return;
+			}
+			memcpy(free_entry->v, l->v, size);
+			free_entry->key = key;
+			free_entry->width = l->width;
+			free_entry->height = l->height;
+			free_entry->used = ++c->clock;
+			c->size += size;
+			return;
+		}
+
+		c->size -= (tarea_t)oldest->width * oldest->height;
+		free(oldest->v);
+		oldest->v = NULL;
+	}
+}
+
+int layer_cache_fetch(layer_cache *c, Uint64 key, layer *l) {
+	tarea_t size = (tarea_t)l->width * l->height;
+	unsigned int i;
+
+	for (i = 0; i < CACHE_ENTRIES; i++) {
+		cache_entry *e = &c->entries[i];
+		if (e->v && e->key == key && e->width == l->width &&
+			e->height == l->height) {
+			memcpy(l->v, e->v, size);
+			e->used = ++c->clock;
+			return EXIT_SUCCESS;
+		}
+	}
+
+	if (!c->directory) {
+		return EXIT_FAILURE;
+	}
+
+	char path[FILENAME_MAX];
+	cache_file(path, c, key, "");
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return EXIT_FAILURE;
+	}
+
+	Uint8 header[CACHE_HEADER_SIZE];
+	tsize_t dimensions[2];
+	int status = cache_io(fd, header, sizeof header, 0);
+	memcpy(dimensions, header + 4, sizeof dimensions);
+	if (status == EXIT_SUCCESS && (memcmp(header, CACHE_MAGIC, 4) != 0 ||
+			dimensions[0] != l->width || dimensions[1] != l->height)) {
+		status = EXIT_FAILURE;
+	}
+	if (status == EXIT_SUCCESS) {
+		status = cache_io(fd, l->v, size, 0);
+	}
+	close(fd);
+
+	if (status == EXIT_SUCCESS) {
+		cache_keep(c, key, l);
+	}
+	return status;
+}
+
+void layer_cache_store(layer_cache *c, Uint64 key, const layer *l) {
+	cache_keep(c, key, l);
+
+	if (!c->directory) {
+		return;
+	}
+
+	char path[FILENAME_MAX], temporary[FILENAME_MAX];
+	char suffix[32];
+	cache_file(path, c, key, "");
+	if (access(path, F_OK) == 0) {
+		return;
+	}
+	snprintf(suffix, sizeof suffix, ".%ld.tmp", (long)getpid());
+	cache_file(temporary, c, key, suffix);
+
+	int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		perror(temporary);
+		return;
+	}
+
+	Uint8 header[CACHE_HEADER_SIZE];
+	tsize_t dimensions[2] = { l->width, l->height };
+	memcpy(header, CACHE_MAGIC, 4);
+	memcpy(header + 4, dimensions, sizeof dimensions);
+	int status = cache_io(fd, header, sizeof header, 1);
+	if (status == EXIT_SUCCESS) {
+		status = cache_io(fd, (Uint8 *)l->v, (tarea_t)l->width * l->height,
+			1);
+	}
+	if (close(fd) == -1 || status == EXIT_FAILURE ||
+		rename(temporary, path) == -1) {
+		perror(temporary);
+		unlink(temporary);
+	}
+}
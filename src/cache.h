@@ -0,0 +1,35 @@
+/*
+Copyright © 2013-2014 Pierre Neidhardt
+See LICENSE file for copyright and license details.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H 1
+
+#include "texture.h"
+
+/* Part of every key, bumped when a stage renders other layers for the same
+ * parameters, so that older layers on disk are not reused. */
+#define CACHE_VERSION 1
+
+/* Start of the keys, and the key of 'size' more bytes of 'data'. */
+#define CACHE_KEY_INIT 0xcbf29ce484222325ull
+Uint64 cache_key(Uint64 key, const void *data, unsigned long size);
+
+/*
+Cache of the layers of the stages, addressed by the key of everything the stage
+reads. Up to 'budget' bytes of layers are kept in memory, the least recently
+used are dropped first. With a 'directory', layers are also written there and
+read back by later runs.
+*/
+layer_cache *layer_cache_create(tarea_t budget, const char *directory);
+void layer_cache_destroy(layer_cache *c);
+
+/*
+Copy the layer of 'key' into 'l', which has the size of the wanted layer.
+Returns EXIT_FAILURE if it is not in the cache.
+*/
+int layer_cache_fetch(layer_cache *c, Uint64 key, layer *l);
+void layer_cache_store(layer_cache *c, Uint64 key, const layer *l);
+
+#endif /* CACHE_H */
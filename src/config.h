@@ -11,13 +11,23 @@ See LICENSE file for copyright and license details.
 /* #define RANDOMGEN_FACTOR 22695477 */
 /* #define RANDOMGEN_OFFSET 1 */
 
-#define OUTPUT_RANDOM "result_random.bmp"
-#define OUTPUT_RGB "result_RGB.bmp"
-#define OUTPUT_GS "result_GS.bmp"
-#define OUTPUT_ALT "result_alt.bmp"
-#define OUTPUT_RGB_SMOOTH "result_RGB_smooth.bmp"
-#define OUTPUT_GS_SMOOTH "result_GS_smooth.bmp"
-#define OUTPUT_ALT_SMOOTH "result_alt_smooth.bmp"
+/* Output files are the prefix followed by the OUTPUT_* names. In batch mode the
+ * prefix is the name of the input instead, e.g. wood_RGB.bmp for wood.ptx. The
+ * extension depends on the format. */
+#define OUTPUT_PREFIX "result"
+#define OUTPUT_RANDOM "_random"
+#define OUTPUT_RGB "_RGB"
+#define OUTPUT_GS "_GS"
+#define OUTPUT_ALT "_alt"
+#define OUTPUT_RGB_SMOOTH "_RGB_smooth"
+#define OUTPUT_GS_SMOOTH "_GS_smooth"
+#define OUTPUT_ALT_SMOOTH "_alt_smooth"
+
+/* Default memory budget of the streaming mode, in bytes. */
+#define STREAM_DEFAULT_MEMORY (64 * 1024 * 1024)
+
+/* Memory budget of the layer cache, in bytes. */
+#define CACHE_DEFAULT_MEMORY (256 * 1024 * 1024)
 
 #ifndef M_PI
 #define M_PI 3.14159265358979323846
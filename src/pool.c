@@ -0,0 +1,235 @@
+/*
+Copyright © 2013-2014 Pierre Neidhardt
+See LICENSE file for copyright and license details.
+*/
+
+/*
+Work-stealing thread pool.
+
+Each worker owns a range of task indices. It takes indices from the front of
+its own range, and when it is empty, it steals the back half of the range of
+another worker. Ranges are protected by a per-worker mutex, which is cheap
+since there is almost no contention: the owner only locks to take one index.
+
+The calling thread is worker 0, so a pool of N threads spawns N - 1 threads.
+*/
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	unsigned long begin;
+	unsigned long end;
+	pool *owner;
+	unsigned int id;
+} worker;
+
+struct pool {
+	unsigned int threads;
+	worker *workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wakeup;
+	pthread_cond_t done;
+
+	/* Current job. 'generation' changes on every new job. */
+	unsigned long generation;
+	pool_task task;
+	void *data;
+	unsigned int running;
+	int status;
+	int quit;
+};
+
+static int take(worker *w, unsigned long *index) {
+	int found = 0;
+	pthread_mutex_lock(&w->lock);
+	if (w->begin < w->end) {
+		*index = w->begin++;
+		found = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return found;
+}
+
+static int steal(worker *w, unsigned long *index) {
+	pool *p = w->owner;
+	unsigned int k;
+
+	for (k = 1; k < p->threads; k++) {
+		worker *victim = &p->workers[(w->id + k) % p->threads];
+		unsigned long begin = 0, end = 0;
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->begin < victim->end) {
+			end = victim->end;
+			begin = victim->begin + (victim->end - victim->begin) / 2;
+			victim->end = begin;
+		}
+		pthread_mutex_unlock(&victim->lock);
+
+		if (begin < end) {
+			*index = begin;
+			pthread_mutex_lock(&w->lock);
+			w->begin = begin + 1;
+			w->end = end;
+			pthread_mutex_unlock(&w->lock);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void work(worker *w) {
+	pool *p = w->owner;
+	unsigned long index;
+	int status = EXIT_SUCCESS;
+
+	while (take(w, &index) || steal(w, &index)) {
+		if (p->task(p->data, index) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+		}
+	}
+
+	pthread_mutex_lock(&p->lock);
+	if (status == EXIT_FAILURE) {
+		p->status = EXIT_FAILURE;
+	}
+	p->running--;
+	if (p->running == 0) {
+		pthread_cond_signal(&p->done);
+	}
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void *worker_loop(void *arg) {
+	worker *w = arg;
+	pool *p = w->owner;
+	unsigned long seen = 0;
+
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (p->generation == seen && !p->quit) {
+			pthread_cond_wait(&p->wakeup, &p->lock);
+		}
+		if (p->quit) {
+			pthread_mutex_unlock(&p->lock);
+			return NULL;
+		}
+		seen = p->generation;
+		pthread_mutex_unlock(&p->lock);
+
+		work(w);
+	}
+}
+
+pool *pool_create(unsigned int threads) {
+	pool *p = calloc(1, sizeof (pool));
+	if (!p) {
+		return NULL;
+	}
+
+	p->threads = threads == 0 ? 1 : threads;
+	p->workers = calloc(p->threads, sizeof (worker));
+	if (!p->workers) {
+		free(p);
+		return NULL;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wakeup, NULL);
+	pthread_cond_init(&p->done, NULL);
+
+	unsigned int k;
+	for (k = 0; k < p->threads; k++) {
+		p->workers[k].owner = p;
+		p->workers[k].id = k;
+		pthread_mutex_init(&p->workers[k].lock, NULL);
+	}
+
+	for (k = 1; k < p->threads; k++) {
+		if (pthread_create(&p->workers[k].thread, NULL, worker_loop,
+				&p->workers[k]) != 0) {
+			/* Run with the threads we could get. */
+			p->threads = k;
+			break;
+		}
+	}
+
+	return p;
+}
+
+void pool_destroy(pool *p) {
+	if (!p) {
+		return;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->quit = 1;
+	pthread_cond_broadcast(&p->wakeup);
+	pthread_mutex_unlock(&p->lock);
+
+	unsigned int k;
+	for (k = 1; k < p->threads; k++) {
+		pthread_join(p->workers[k].thread, NULL);
+	}
+	for (k = 0; k < p->threads; k++) {
+		pthread_mutex_destroy(&p->workers[k].lock);
+	}
+
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->wakeup);
+	pthread_mutex_destroy(&p->lock);
+	free(p->workers);
+	free(p);
+}
+
+unsigned int pool_threads(const pool *p) {
+	return p ? p->threads : 1;
+}
+
+int pool_run(pool *p, unsigned long count, pool_task task, void *data) {
+	unsigned long index;
+	int status = EXIT_SUCCESS;
+
+	if (!p || p->threads == 1 || count <= 1) {
+		for (index = 0; index < count; index++) {
+			if (task(data, index) == EXIT_FAILURE) {
+				status = EXIT_FAILURE;
+			}
+		}
+		return status;
+	}
+
+	/* Spread the indices evenly. Workers are idle at this point, so there is
+	 * no need to lock their ranges. */
+	unsigned int k;
+	for (k = 0; k < p->threads; k++) {
+		p->workers[k].begin = count * k / p->threads;
+		p->workers[k].end = count * (k + 1) / p->threads;
+	}
+
+	pthread_mutex_lock(&p->lock);
+	p->task = task;
+	p->data = data;
+	p->status = EXIT_SUCCESS;
+	p->running = p->threads;
+	p->generation++;
+	pthread_cond_broadcast(&p->wakeup);
+	pthread_mutex_unlock(&p->lock);
+
+	work(&p->workers[0]);
+
+	pthread_mutex_lock(&p->lock);
+	while (p->running != 0) {
+		pthread_cond_wait(&p->done, &p->lock);
+	}
+	status = p->status;
+	pthread_mutex_unlock(&p->lock);
+
+	return status;
+}
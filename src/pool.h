@@ -0,0 +1,33 @@
+/*
+Copyright © 2013-2014 Pierre Neidhardt
+See LICENSE file for copyright and license details.
+*/
+
+#ifndef POOL_H
+#define POOL_H 1
+
+/*
+A task processes the item 'index' of a job. It returns EXIT_SUCCESS or
+EXIT_FAILURE. Tasks of a same job run concurrently, so they must write to
+disjoint memory.
+*/
+typedef int (*pool_task)(void *data, unsigned long index);
+
+typedef struct pool pool;
+
+/*
+Create a pool of 'threads' workers, the calling thread included. With 0 or 1
+thread, no thread is spawned and jobs run in the caller.
+*/
+pool *pool_create(unsigned int threads);
+void pool_destroy(pool *p);
+
+unsigned int pool_threads(const pool *p);
+
+/*
+Run 'task' on every index in [0, count[ and wait for completion. Returns
+EXIT_FAILURE if any task failed. A NULL pool runs the job serially.
+*/
+int pool_run(pool *p, unsigned long count, pool_task task, void *data);
+
+#endif /* POOL_H */
@@ -0,0 +1,433 @@
+/*
+Copyright © 2013-2014 Pierre Neidhardt
+See LICENSE file for copyright and license details.
+*/
+
+/*
+Benchmark of the rendering stages on synthetic textures, over a grid of sizes,
+octaves, smoothing factors and thread counts. Results are printed as JSON on the
+standard output, so that versions can be compared.
+
+Every configuration runs in its own process: the peak RSS it reports is its own,
+not the peak of the largest configuration run so far.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "config.h"
+#include "pool.h"
+#include "texture.h"
+
+#define STRINGIFY(x) #x
+#define STRING(x) STRINGIFY(x)
+
+/* Maximum number of values of a grid parameter. */
+#define GRID_MAX 32
+
+/* Buffer of the JSON object of a configuration. */
+#define BENCH_OBJECT_SIZE 4096
+
+typedef struct {
+	unsigned long v[GRID_MAX];
+	unsigned int count;
+} grid_list;
+
+typedef struct {
+	grid_list sizes;
+	grid_list octaves;
+	grid_list smoothing;
+	grid_list threads;
+	/* Each stage is run this many times and the best time is kept. */
+	unsigned long repeat;
+	/* Directory of the output files. They are removed after each run. */
+	const char *dir;
+	/* Back the layers with transparent hugepages. */
+	int hugepages;
+} bench_grid;
+
+typedef struct {
+	tsize_t size;
+	Uint16 octaves;
+	Uint8 smoothing;
+	unsigned int threads;
+} bench_config;
+
+/******************************************************************************/
+
+double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Print the timing of a stage in the "stages" object. */
+void print_stage(unsigned int *stages, const char *name, const char *suffix,
+	const layer *l, double seconds) {
+	double mpixels = (double)l->width * l->height / 1e6;
+	printf("%s\"%s%s\": {\"seconds\": %.6f, \"mpixel_per_s\": %.3f}",
+		*stages > 0 ? ", " : "", name, suffix, seconds,
+		seconds > 0 ? mpixels / seconds : 0);
+	(*stages)++;
+}
+
+/* Texture of the configuration, with the colors of data/wood.ptx. */
+void bench_texture(texture_parameter *tparam, const bench_config *c) {
+	texture_parameter t = {
+		c->size, c->size, 23784, c->octaves, 4, 1, 2, 20, 120, 255,
+		{100, 80, 0}, {51, 51, 0}, {100, 51, 0}, c->smoothing
+	};
+	*tparam = t;
+}
+
+/* Write and time the outputs from 'first' to 'last', one at a time. */
+int bench_save(unsigned int *stages, layer *l, unsigned int first,
+	unsigned int last, const color_param *colors, const render_options *opt,
+	unsigned long repeat) {
+	unsigned int r;
+	unsigned long k;
+
+	for (r = first; r <= last; r++) {
+		double best = -1;
+		for (k = 0; k < repeat; k++) {
+			double start = now();
+			if (save_results(l, r, r, colors, opt) == EXIT_FAILURE) {
+				return EXIT_FAILURE;
+			}
+			double seconds = now() - start;
+			if (best < 0 || seconds < best) {
+				best = seconds;
+			}
+		}
+		print_stage(stages, "save_", result_keys[r], l, best);
+
+		char file[FILENAME_MAX];
+		if (result_file(file, r, opt) == EXIT_SUCCESS) {
+			remove(file);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+Run the stages of render() separately for one configuration, and print its JSON
+object. Layers come from an arena so that repeated runs do not time page faults.
+*/
+int bench_run(const bench_config *c, const bench_grid *grid) {
+	char prefix[FILENAME_MAX];
+	snprintf(prefix, sizeof prefix, "%s/bench", grid->dir);
+
+	texture_parameter tparam;
+	bench_texture(&tparam, c);
+	color_param colors;
+	color_param_init(&colors, &tparam);
+
+	layer_arena arena;
+	layer_arena_init(&arena, grid->hugepages);
+	layer_arena_reset(&arena, c->size, c->size, RENDER_LAYERS);
+	render_options opt = {0};
+	opt.outputs = RESULT_DEFAULT;
+	opt.prefix = prefix;
+	opt.arena = &arena;
+	opt.workers = pool_create(c->threads);
+	if (!opt.workers) {
+		layer_arena_free(&arena);
+		trace("Could not create thread pool.");
+		return EXIT_FAILURE;
+	}
+
+	double persistence = (double)tparam.persistence_num / tparam.persistence_den;
+	double best[3] = {-1, -1, -1};
+	layer base, smoothed;
+	unsigned int stages = 0;
+	unsigned long k;
+	int status = EXIT_SUCCESS;
+
+	printf("{\"size\": %lu, \"octaves\": %u, \"smoothing\": %u, "
+		"\"threads\": %u, \"stages\": {", (unsigned long)c->size,
+		(unsigned int)c->octaves, (unsigned int)c->smoothing, c->threads);
+
+	for (k = 0; k < grid->repeat && status == EXIT_SUCCESS; k++) {
+		layer random_layer;
+		double start = now();
+		status = generate_random_layer(&random_layer, c->size, c->size,
+				tparam.seed, &opt);
+		double seconds = now() - start;
+		layer_release(&random_layer, &opt);
+		if (best[0] < 0 || seconds < best[0]) {
+			best[0] = seconds;
+		}
+	}
+
+	if (status == EXIT_FAILURE ||
+		layer_acquire(&base, c->size, c->size, &opt) == EXIT_FAILURE) {
+		status = EXIT_FAILURE;
+		goto clean;
+	}
+	for (k = 0; k < grid->repeat && status == EXIT_SUCCESS; k++) {
+		double start = now();
+		status = generate_work_layer(tparam.frequency, tparam.octaves,
+				persistence, tparam.seed, &base, &opt);
+		double seconds = now() - start;
+		if (best[1] < 0 || seconds < best[1]) {
+			best[1] = seconds;
+		}
+	}
+	if (status == EXIT_FAILURE) {
+		layer_release(&base, &opt);
+		goto clean;
+	}
+
+	print_stage(&stages, "random", "", &base, best[0]);
+	print_stage(&stages, "work", "", &base, best[1]);
+	status = bench_save(&stages, &base, RESULT_GS, RESULT_ALT, &colors, &opt,
+			grid->repeat);
+
+	if (c->smoothing != 0 && status == EXIT_SUCCESS) {
+		for (k = 0; k < grid->repeat && status == EXIT_SUCCESS; k++) {
+			if (k > 0) {
+				layer_release(&smoothed, &opt);
+			}
+			double start = now();
+			status = smooth_layer(&smoothed, c->smoothing, &base, &opt);
+			double seconds = now() - start;
+			if (best[2] < 0 || seconds < best[2]) {
+				best[2] = seconds;
+			}
+		}
+		if (status == EXIT_SUCCESS) {
+			print_stage(&stages, "smooth", "", &smoothed, best[2]);
+			status = bench_save(&stages, &smoothed, RESULT_GS_SMOOTH, RESULT_ALT_SMOOTH,
+					&colors, &opt, grid->repeat);
+			layer_release(&smoothed, &opt);
+		}
+	}
+	layer_release(&base, &opt);
+
+clean:
+	layer_arena_free(&arena);
+	pool_destroy(opt.workers);
+
+	/* ru_maxrss is in kilobytes on Linux. */
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	printf("}, \"peak_rss_kb\": %ld}", usage.ru_maxrss);
+	return status;
+}
+
+/*
+Run one configuration in a child process. Its JSON object is only printed if the
+run succeeded, so that a failed run does not leave a truncated object.
+*/
+int bench_fork(const bench_config *c, const bench_grid *grid) {
+	int fds[2];
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		return EXIT_FAILURE;
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return EXIT_FAILURE;
+	}
+	if (pid == 0) {
+		close(fds[0]);
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[1]);
+		int status = bench_run(c, grid);
+		fflush(stdout);
+		_exit(status);
+	}
+
+	close(fds[1]);
+	char object[BENCH_OBJECT_SIZE];
+	size_t length = 0;
+	ssize_t n;
+	while ((n = read(fds[0], object + length, sizeof object - 1 - length)) > 0) {
+		length += n;
+	}
+	object[length] = '\0';
+	close(fds[0]);
+
+	int status;
+	if (waitpid(pid, &status, 0) < 0) {
+		perror("waitpid");
+		return EXIT_FAILURE;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS || n < 0) {
+		return EXIT_FAILURE;
+	}
+	fputs(object, stdout);
+	return EXIT_SUCCESS;
+}
+
+/******************************************************************************/
+
+/* Parse a comma-separated list of values between 'min' and 'max'. */
+int parse_list(const char *arg, grid_list *list, unsigned long min,
+	unsigned long max) {
+	char *end;
+	list->count = 0;
+
+	do {
+		unsigned long v = strtoul(arg, &end, 10);
+		if (end == arg || v < min || v > max || list->count == GRID_MAX ||
+			(*end != ',' && *end != '\0')) {
+			return EXIT_FAILURE;
+		}
+		list->v[list->count++] = v;
+		arg = end + 1;
+	} while (*end != '\0');
+
+	return EXIT_SUCCESS;
+}
+
+void usage(const char *cmdname) {
+	printf("%s [OPTIONS]\n\n", cmdname);
+	puts("Time the rendering stages over a grid of synthetic textures and print");
+	puts("the results as JSON. Lists are comma-separated.\n");
+	puts("Options:");
+	puts("  -d, --dir DIR  Directory of the output files (default: a temporary");
+	puts("                 directory). Files are removed after each run.");
+	puts("  -H, --hugepages");
+	puts("                 Back the layers with transparent hugepages.");
+	puts("  -h, --help     Print this help.");
+	puts("  -j, --jobs LIST");
+	puts("                 Thread counts (default: 1 and the number of CPUs).");
+	puts("  -o, --octaves LIST");
+	puts("                 Octaves (default: 1,4,8).");
+	puts("  -r, --repeat N Keep the best time of N runs of every stage");
+	puts("                 (default: 1).");
+	puts("  -s, --sizes LIST");
+	puts("                 Texture sizes (default: 256,512,1024,2048,4096,8192).");
+	puts("  -S, --smoothing LIST");
+	puts("                 Smoothing factors, 0 to skip (default: 0,8,32).");
+}
+
+int main(int argc, char **argv) {
+	bench_grid grid;
+	memset(&grid, 0, sizeof grid);
+	parse_list("256,512,1024,2048,4096,8192", &grid.sizes, 1, (tsize_t)-1);
+	parse_list("1,4,8", &grid.octaves, 1, 0xffff);
+	parse_list("0,8,32", &grid.smoothing, 0, 0xff);
+	grid.threads.v[grid.threads.count++] = 1;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 1) {
+		grid.threads.v[grid.threads.count++] = cpus;
+	}
+	grid.repeat = 1;
+
+	static const struct option long_options[] = {
+		{"dir", required_argument, NULL, 'd'},
+		{"help", no_argument, NULL, 'h'},
+		{"hugepages", no_argument, NULL, 'H'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"octaves", required_argument, NULL, 'o'},
+		{"repeat", required_argument, NULL, 'r'},
+		{"sizes", required_argument, NULL, 's'},
+		{"smoothing", required_argument, NULL, 'S'},
+		{NULL, 0, NULL, 0}
+	};
+
+	grid_list repeat;
+	int c;
+	while ((c = getopt_long(argc, argv, "d:Hhj:o:r:s:S:", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'd':
+			grid.dir = optarg;
+			break;
+		case 'H':
+			grid.hugepages = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		case 'j':
+			if (parse_list(optarg, &grid.threads, 1, 1024) == EXIT_FAILURE) {
+				trace("Invalid thread counts.");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (parse_list(optarg, &grid.octaves, 1, 0xffff) == EXIT_FAILURE) {
+				trace("Invalid octaves.");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'r':
+			if (parse_list(optarg, &repeat, 1, 1000) == EXIT_FAILURE ||
+				repeat.count != 1) {
+				trace("Invalid repeat count.");
+				return EXIT_FAILURE;
+			}
+			grid.repeat = repeat.v[0];
+			break;
+		case 's':
+			if (parse_list(optarg, &grid.sizes, 1, (tsize_t)-1) == EXIT_FAILURE) {
+				trace("Invalid sizes.");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			if (parse_list(optarg, &grid.smoothing, 0, 0xff) == EXIT_FAILURE) {
+				trace("Invalid smoothing factors.");
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	char tmpdir[] = "/tmp/ptg-bench.XXXXXX";
+	if (grid.dir == NULL) {
+		if (mkdtemp(tmpdir) == NULL) {
+			perror("mkdtemp");
+			return EXIT_FAILURE;
+		}
+		grid.dir = tmpdir;
+	}
+
+	printf("{\"version\": \"%s\", \"results\": [", STRING(VERSION));
+
+	int status = EXIT_SUCCESS;
+	int first = 1;
+	unsigned int s, o, m, t;
+	for (s = 0; s < grid.sizes.count; s++) {
+		for (o = 0; o < grid.octaves.count; o++) {
+			for (m = 0; m < grid.smoothing.count; m++) {
+				for (t = 0; t < grid.threads.count; t++) {
+					bench_config config = {
+						grid.sizes.v[s], grid.octaves.v[o], grid.smoothing.v[m],
+						grid.threads.v[t]
+					};
+					printf(first ? "\n  " : ",\n  ");
+					if (bench_fork(&config, &grid) == EXIT_FAILURE) {
+						/* Keep the output valid JSON. */
+						printf("null");
+						status = EXIT_FAILURE;
+					}
+					first = 0;
+				}
+			}
+		}
+	}
+
+	printf("\n]}\n");
+
+	if (grid.dir == tmpdir) {
+		rmdir(tmpdir);
+	}
+	return status;
+}
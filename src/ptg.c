@@ -7,708 +7,522 @@ See LICENSE file for copyright and license details.
 This program takes a procural textures binary descriptor (ptx) file as argument,
 and creates several graphic files showing different steps of the process.
 
-It uses Perlin algorithm. See README for more details.
+The texture itself is generated by the engine in texture.c.
 */
 #include <stdio.h>
 #include <stdlib.h>
-#include <SDL/SDL.h>
-#include <math.h>
-#include <strings.h>
+#include <string.h>
+#include <getopt.h>
 
+#include "cache.h"
 #include "config.h"
-
-/* Typedef for pixel lengths, like texture resolution. We use typedefs to allow
-for customizable max size. */
-typedef Uint32 tsize_t;
-typedef Uint64 tarea_t;
-
-typedef struct {
-	Uint8 red;
-	Uint8 green;
-	Uint8 blue;
-} color;
-
-/* This is the sume of all parameter sizes. */
-#define TEXTURE_FILE_SIZE 29
-
-/**
- * Texture parameters. Note that the persistence is given as two positive
- * integers, the numerator and the denominator. The final persistence is
- *
- *   (double) persistence_num / (double) persistence_den
- *
- * For now only square textures are generated, so we do not use height. It would
- * not require much to implement rectangle support.
- */
-/* TODO: decrease size of the seed? */
-typedef struct {
-	tsize_t width;
-	tsize_t height;
-	Uint16 seed;
-	Uint16 octaves;
-	Uint16 frequency;
-	Uint8 persistence_num;
-	Uint8 persistence_den;
-	Uint8 threshold_red;
-	Uint8 threshold_green;
-	Uint8 threshold_blue;
-	color color1;
-	color color2;
-	color color3;
-	Uint8 smoothing;
-} texture_parameter;
-
-typedef struct {
-	Uint8 *v;
-	tsize_t size;
-} layer;
-
-/******************************************************************************/
-/* Quick strings. Having length is time saving compared to strlen(). */
-typedef struct {
-	char *val;
-	unsigned long length;
-} qstring;
-
-int qstring_init(qstring *s, unsigned long size) {
-	s->val = malloc(size);
-	if (s->val == NULL) {
-		perror("qstring_init");
+#include "pool.h"
+#include "serve.h"
+#include "texture.h"
+
+/* Parse a size in bytes with an optional K, M or G suffix. */
+int parse_memory(const char *arg, tarea_t *size) {
+	char *end;
+	unsigned long long v = strtoull(arg, &end, 10);
+	if (end == arg) {
 		return EXIT_FAILURE;
 	}
-	s->length = size;
-
-	return EXIT_SUCCESS;
-}
-
-void qstring_free(qstring *s) {
-	if (s->val != NULL) {
-		free(s->val);
-	}
-}
-
-/******************************************************************************/
-
-void trace(const char *s) {
-	fprintf(stderr, "==> %s\n", s);
-}
-
-/******************************************************************************/
-
-/*
-Returns a value between 0 and max inclusive.
-*/
-unsigned long randomgen(unsigned long max) {
-	return (unsigned long)((((double)rand()) / RAND_MAX) * max);
-}
-
-/*
-Returns a value between 0 and max inclusive. Must be run the first time with
-a seed, then without a seed.
-
-In this home-made random, we use the following recursive sequence to generate
-random values:
-
-        random_number = ( factor * random_number + offset ) % max
-
-We need to match the following properties to have a decent RNG.
-
-- Offset and max must be coprime
-- If 4 divides max , then factor % 4 == 1
-- For all p dividing max, factor % p == 1
-
-Besides,
-
-- offset must be "small" compared to max;
-- factor must be close to the square root of max.
-*/
-unsigned long custom_randomgen(unsigned long max, unsigned long seed) {
-	static unsigned long random_number = 0;
-	if (seed != 0) {
-		random_number = seed;
-		return random_number;
-	}
 
-	unsigned long factor = RANDOMGEN_FACTOR, offset = RANDOMGEN_OFFSET;
-
-	random_number = (factor * random_number + offset) % max;
-	return random_number;
-}
-
-int init_layer(layer *current_layer, tsize_t size) {
-	if (!current_layer) {
-		trace("Wrong layer, could not initialize.");
-		return EXIT_FAILURE;
+	switch (*end) {
+	case 'G':
+	case 'g':
+		v *= 1024;
+		/* Fallthrough. */
+	case 'M':
+	case 'm':
+		v *= 1024;
+		/* Fallthrough. */
+	case 'K':
+	case 'k':
+		v *= 1024;
+		end++;
+		break;
 	}
 
-	tarea_t memsize = (tarea_t)size * (tarea_t)size;
-	current_layer->v = malloc(memsize * sizeof (Uint8));
-
-	if (!current_layer->v) {
-		trace("Allocation error.");
+	if (*end != '\0') {
 		return EXIT_FAILURE;
 	}
-
-	memset(current_layer->v, 0, memsize);
-	current_layer->size = size;
-
+	*size = v;
 	return EXIT_SUCCESS;
 }
 
-void free_layer(layer *l) {
-	free(l->v);
-}
-
-Uint8 *at_layer(layer *l, tsize_t i, tsize_t j) {
-	return &(l->v[(tarea_t)i * (tarea_t)l->size + (tarea_t)j]);
-}
-
-
-/* SDL function to color a specific pixel on "screen". */
-void color_pixel(SDL_Surface *screen, tsize_t x, tsize_t y, tsize_t red,
-	Uint8 green, Uint8 blue) {
-	Uint32 map = SDL_MapRGB(screen->format, red, green, blue);
-	*((Uint32 *)(screen->pixels) + x + y * screen->w) = map;
-}
-
-/* Grayscale bitmap. */
-int save_bmp(layer *current_layer, const char *filename) {
-	SDL_Surface *screen =
-		SDL_CreateRGBSurface(SDL_SWSURFACE, current_layer->size,
-			current_layer->size, 32, 0, 0, 0,
-			0);
-	if (!screen) {
-		trace("SDL error on SDL_CreateRGBSurface");
-		return EXIT_FAILURE;
-	}
-
-	/* The last three args of color_pixel are red, green and blue values. For
-	 * grayscale, we provide 3 times the same value. */
-	tsize_t i, j;
-	for (i = 0; i < current_layer->size; i++) {
-		for (j = 0; j < current_layer->size; j++) {
-			color_pixel(screen, i, j, *at_layer(current_layer, i, j),
-				*at_layer(current_layer, i, j),
-				*at_layer(current_layer, i, j));
+/* Parse a window as X,Y,WIDTH,HEIGHT. */
+int parse_region(const char *arg, region *window) {
+	tsize_t *fields[4] = {
+		&window->x, &window->y, &window->width, &window->height
+	};
+	unsigned int k;
+	char *end;
+
+	for (k = 0; k < 4; k++) {
+		unsigned long v = strtoul(arg, &end, 10);
+		if (end == arg || v > (tsize_t)-1 ||
+			*end != (k < 3 ? ',' : '\0')) {
+			return EXIT_FAILURE;
 		}
+		*fields[k] = v;
+		arg = end + 1;
 	}
 
-	SDL_SaveBMP(screen, filename);
-	SDL_FreeSurface(screen);
-
-	return EXIT_SUCCESS;
+	return window->width == 0 || window->height == 0 ? EXIT_FAILURE :
+		EXIT_SUCCESS;
 }
 
-/*
-In the whole program layers are encoded in grayscale. To add colors, we use the
-three colors and thresholds provided as argument.
-*/
-int save_bmp_rgb(layer *current_layer, const char *filename,
-	Uint8 threshold_red, Uint8 threshold_green,
-	Uint8 threshold_blue, color color1, color color2, color color3) {
-	SDL_Surface *screen =
-		SDL_CreateRGBSurface(SDL_SWSURFACE, current_layer->size,
-			current_layer->size, 32, 0, 0, 0, 0);
-	if (!screen) {
-		trace("SDL error on SDL_CreateRGBSurface");
-		return EXIT_FAILURE;
-	}
-
-	tsize_t i, j;
-
-	for (i = 0; i < current_layer->size; i++) {
-		for (j = 0; j < current_layer->size; j++) {
-			Uint8 red, green, blue;
-			double f;
-
-			if (*at_layer(current_layer, i, j) < threshold_red) {
-				red = color1.red;
-				green = color1.green;
-				blue = color1.blue;
-			} else if (*at_layer(current_layer, i, j) < threshold_green) {
-				f = (double)(*at_layer(current_layer, i, j) -
-					threshold_red) / (threshold_green -
-					threshold_red);
-				red = (color1.red * (1 - f) + color2.red * (f));
-				green = (color1.green * (1 - f) + color2.green * (f));
-				blue = (color1.blue * (1 - f) + color2.blue * (f));
-			} else if (*at_layer(current_layer, i, j) < threshold_blue) {
-				f = (double)(*at_layer(current_layer, i, j) -
-					threshold_green) / (threshold_blue -
-					threshold_green);
-				red = (color2.red * (1 - f) + color3.red * (f));
-				green = (color2.green * (1 - f) + color3.green * (f));
-				blue = (color2.blue * (1 - f) + color3.blue * (f));
-			} else {
-				f = (double)(*at_layer(current_layer, i, j) -
-					threshold_blue) / (255 - threshold_blue);
-				red = color3.red;
-				green = color3.green;
-				blue = color3.blue;
+/* Parse a comma-separated list of output names into RESULT_BIT() flags. */
+int parse_outputs(const char *arg, unsigned int *outputs) {
+	unsigned int r;
+	*outputs = 0;
+
+	while (*arg != '\0') {
+		size_t length = strcspn(arg, ",");
+		for (r = 0; r < RESULT_COUNT; r++) {
+			if (strlen(result_keys[r]) == length &&
+				strncmp(arg, result_keys[r], length) == 0) {
+				break;
 			}
+		}
+		if (r == RESULT_COUNT) {
+			return EXIT_FAILURE;
+		}
+#ifndef DEBUG
+		if (r == RESULT_RANDOM) {
+			trace("The random output is only available in debug builds.");
+			return EXIT_FAILURE;
+		}
+#endif
+		*outputs |= RESULT_BIT(r);
 
-			color_pixel(screen, i, j, red, green, blue);
+		arg += length;
+		if (*arg == ',') {
+			arg++;
 		}
 	}
 
-	SDL_SaveBMP(screen, filename);
-	SDL_FreeSurface(screen);
-
-	return EXIT_SUCCESS;
+	return *outputs == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-/*
-Same as save_bmp_rgb but with cosine interpolation for colors. Result is more
-"liquid". Note the mirrored value around threshold/2. This is what gives the
-wave effect.
-*/
-int save_bmp_alt(layer *current_layer,
-	const char *filename, Uint8 threshold, color color1,
-	color color2) {
-	SDL_Surface *screen =
-		SDL_CreateRGBSurface(SDL_SWSURFACE, current_layer->size,
-			current_layer->size, 32, 0, 0, 0,
-			0);
-	if (!screen) {
-		trace("SDL error on SDL_CreateRGBSurface");
-		return EXIT_FAILURE;
-	}
-
-	tsize_t i, j;
-	for (i = 0; i < current_layer->size; i++) {
-		for (j = 0; j < current_layer->size; j++) {
-			Uint8 red, green, blue;
-
-			double value = fmod(*at_layer(current_layer, i, j), threshold);
-			if (value > threshold / 2) {
-				value = threshold - value;
-			}
-
-			double f = (1 - cos(M_PI * value / (threshold / 2))) / 2;
-
-			red = color1.red * (1 - f) + color2.red * f;
-			green = color1.green * (1 - f) + color2.green * f;
-			blue = color1.blue * (1 - f) + color2.blue * f;
-
-			color_pixel(screen, i, j, red, green, blue);
+/* Parse a name among the 'count' names of 'keys' into its index. */
+int parse_key(const char *arg, const char **keys, int count, int *value) {
+	int k;
+	for (k = 0; k < count; k++) {
+		if (strcmp(arg, keys[k]) == 0) {
+			*value = k;
+			return EXIT_SUCCESS;
 		}
 	}
-
-	SDL_SaveBMP(screen, filename);
-	SDL_FreeSurface(screen);
-	return EXIT_SUCCESS;
+	return EXIT_FAILURE;
 }
 
-/*
-Using cubic splines. We use a cubic polinom p(x) = a + b*x + c*x^2 + d*x^3 so
-that
-
-        p(0) = y1
-        p(1) = y2
-        p'(0) = 0
-        p'(1) = 0
-
-We want the border to be smooth, hence the flat tangent. The uniq resulting
-polynom is
-
-        p(x) = y1 [ 3 * (1-x)^2 - 2 (1-x)^3 ] + y2 [ 3*x^2 -2*x^3 ]
-
-Here x is delta / step. delta is the distance to y1, step is the distance
-between y1 and y2. We normalize everything to [0,1] to get the previous
-property.
-
-We use 'long' type for y1 and y2 arguments on purpose, so that it can be used
-in any context. (This is debatable.)
- */
-long interpol(long y1, long y2, tsize_t step, tsize_t delta) {
-	/* step == 0 should never happen. */
-	if (step == 0) {
-		return y1;
-	}
-	if (step == 1) {
-		return y2;
-	}
-
-	double a = (double)1 - (double)delta / step;
-	double b = (double)delta / step;
-
-	double fac1 = 3 * (a * a) - 2 * (a * a * a);
-	double fac2 = 3 * (b * b) - 2 * (b * b * b);
-
-	return y1 * fac1 + y2 * fac2;
-
-	/* Linear interpolation. Unused. */
-	/*
-	   if (n!=0)
-	   return y1+delta*((double)y2-(double)y1)/(double)n;
-	   else
-	   return y1;
-	 */
-}
-
-Uint8 interpol_val(tsize_t i, tsize_t j, Uint16 frequency, layer *current_layer) {
-	/* Bound values are the four corners of the square in which the point (i,j)
-	 * is. The square is actually the grid computed upon the frequency and the
-	 * size of the layout. */
-	tsize_t bound1i, bound1j, bound2i, bound2j;
-
-	tsize_t step = current_layer->size / frequency;
-	if (step == 0) {
-		return *at_layer(current_layer, i, j);
-	}
-
-	bound1i = i / step * step;
-	bound2i = bound1i + step;
-
-	if (bound2i >= current_layer->size) {
-		bound2i = current_layer->size - 1;
+/* Render the texture described in file 'filename'. */
+int render_file(const char *filename, const render_options *opt) {
+	FILE *file = NULL;
+	file = fopen(filename, "rb");
+	if (file == NULL) {
+		trace("Could not open file:");
+		trace(filename);
+		return EXIT_FAILURE;
 	}
 
-	bound1j = j / step * step;
-	bound2j = bound1j + step;
+	fseek(file, 0, SEEK_END);
+	unsigned long file_size = ftell(file);
+	fseek(file, 0, SEEK_SET);
 
-	if (bound2j >= current_layer->size) {
-		bound2j = current_layer->size - 1;
+	/* One more byte for the terminating null read_opt() checks. */
+	qstring file_buf;
+	if (qstring_init(&file_buf, file_size + 1) == EXIT_FAILURE) {
+		perror(filename);
+		fclose(file);
+		return EXIT_FAILURE;
 	}
 
-	Uint8 b11, b12, b21, b22;
-	b11 = *at_layer(current_layer, bound1i, bound1j);
-	b12 = *at_layer(current_layer, bound1i, bound2j);
-	b21 = *at_layer(current_layer, bound2i, bound1j);
-	b22 = *at_layer(current_layer, bound2i, bound2j);
-
-	Uint8 v1 = interpol(b11, b12, step, j - bound1j);
-	Uint8 v2 = interpol(b21, b22, step, j - bound1j);
-	Uint8 result = interpol(v1, v2, step, i - bound1i);
-
-	return result;
-}
-
-int generate_random_layer(layer *random_layer, layer *c, Uint32 seed) {
-	/* Values are only on 0..255, so it's gray scale. We add colors only when we
-	 * save/render the picture. */
-	tsize_t size = c->size;
-	tsize_t i, j;
+	file_buf.length = fread(file_buf.val, 1, file_size, file);
+	file_buf.val[file_buf.length] = '\0';
+	fclose(file);
 
-	if (init_layer(random_layer, size) == EXIT_FAILURE) {
-		trace("Could not init random layer.");
+	/* Texture parameters. */
+	texture_parameter tparam;
+	if (read_opt(&file_buf, &tparam) == EXIT_FAILURE) {
+		trace("Texture file is corrupted.");
+		qstring_free(&file_buf);
 		return EXIT_FAILURE;
 	}
+	qstring_free(&file_buf);
 
-	/* Init seeds for both std and home-made RNG. We do not use the home-made
-	 * RNG here. */
-	srand(seed);
-	/* custom_randomgen (0, seed); */
-	for (i = 0; i < size; i++) {
-		for (j = 0; j < size; j++) {
-			/* random_layer->v[i][j] = custom_randomgen (255, 0); */
-			random_layer->v[i * random_layer->size + j] = randomgen(255);
-		}
-	}
-
-	return EXIT_SUCCESS;
-}
-
-int generate_work_layer(Uint16 frequency,
-	Uint16 octaves,
-	double persistence,
-	layer *current_layer, layer *random_layer) {
-	tsize_t size = current_layer->size;
-	tsize_t i, j;
-	Uint16 n;               /* Current octave. */
-	Uint16 f = frequency;   /* Current frequency. Changes with octaves. */
-	double sum_persistences = 0;
-
-	layer *work_layers = malloc(octaves * sizeof (layer));
-	double *work_persistence = malloc(octaves * sizeof (double));
-	for (n = 0; n < octaves; n++) {
-		if (init_layer(&(work_layers[n]), size) == EXIT_FAILURE) {
-			return EXIT_FAILURE;
-		}
-
-		for (i = 0; i < size; i++) {
-			for (j = 0; j < size; j++) {
-				*at_layer(&(work_layers[n]), i, j) =
-					interpol_val(i, j, f, random_layer);
-			}
-		}
+	/* Print the details to output. */
+	texture_details(&tparam);
 
-		f *= frequency;
-		if (n == 0) {
-			work_persistence[n] = persistence;
-		} else {
-			work_persistence[n] = work_persistence[n - 1] * persistence;
-		}
-		sum_persistences += work_persistence[n];
+	if (opt->stats) {
+		opt->stats->texture = filename;
 	}
 
-	/* Sum of the consecutive layers for every pixel. */
-	for (i = 0; i < size; i++) {
-		for (j = 0; j < size; j++) {
-			for (n = 0; n < octaves; n++) {
-				*at_layer(current_layer, i, j) +=
-					*at_layer(&(work_layers[n]), i, j) * work_persistence[n];
-			}
-			/* Normalizing. */
-			*at_layer(current_layer, i, j) =
-				*at_layer(current_layer, i, j) / sum_persistences;
-		}
+	if (opt->frames) {
+		return animate_render(&tparam, opt);
 	}
-
-	/* Clean. */
-	free(work_persistence);
-	for (n = 0; n < octaves; n++) {
-		free_layer(&(work_layers[n]));
+	if (opt->stream) {
+		return stream_render(&tparam, opt);
 	}
-	free(work_layers);
-
-	return EXIT_SUCCESS;
+	return render(&tparam, opt);
 }
 
 /*
-We set the x,y pixel to be the mean of all pixels in the k,l square around
-it. The new pixel value type needs to be higher than traditionnal pixel
-because we sum pixels and thus it may overflow. The damping factor is the
-number of pixels in the square. We need to compute it every time when we are
-close to a border and k,l is no longer a square.
+Render a texture of a batch. Outputs are named after the input file, without
+directory nor extension, so that the textures of a batch do not collide.
 */
-int smooth_layer(layer *smoothed_layer, tsize_t factor, layer *current_layer) {
-	tsize_t size = current_layer->size;
-	long damping;
-	tsize_t x, y;           /* Point coordinates */
-	tsize_t k, l;           /* Coordinates of the points in the square around (x,y). */
-	double pixel_val;
-
-	if (init_layer(smoothed_layer, size) == EXIT_FAILURE) {
-		trace("Could not init smoothed layer.");
+int batch_render(const char *filename, const render_options *opt) {
+	char prefix[FILENAME_MAX];
+	const char *name = strrchr(filename, '/');
+	name = name ? name + 1 : filename;
+	const char *dot = strrchr(name, '.');
+	size_t length = dot && dot != name ? (size_t)(dot - name) : strlen(name);
+
+	if (length >= FILENAME_MAX) {
+		trace("Input file name is too long.");
 		return EXIT_FAILURE;
 	}
+	memcpy(prefix, name, length);
+	prefix[length] = '\0';
 
-	for (x = 0; x < size; x++) {
-		for (y = 0; y < size; y++) {
-			pixel_val = 0;
-			damping = 0;
-
-			size_t kbegin, kend, lbegin, lend; /* Ranges. */
-			kbegin = factor > x ? 0 : x - factor;
-			lbegin = factor > y ? 0 : y - factor;
-			kend = factor >= size - x ? size - 1 : x + factor;
-			lend = factor >= size - y ? size - 1 : y + factor;
-
-			for (k = kbegin; k <= kend; k++) {
-				for (l = lbegin; l <= lend; l++) {
-					damping++;
-					pixel_val += *at_layer(current_layer, k, l);
-				}
-			}
-			*at_layer(smoothed_layer, x, y) = (double)pixel_val / damping;
-		}
+	render_options batch_opt = *opt;
+	batch_opt.prefix = prefix;
+	if (render_file(filename, &batch_opt) == EXIT_FAILURE) {
+		trace("Texture failed:");
+		trace(filename);
+		return EXIT_FAILURE;
 	}
-
 	return EXIT_SUCCESS;
 }
 
-/******************************************************************************/
-
-void texture_details(texture_parameter *tparam) {
-	if (tparam == NULL) {
-		return;
-	}
-
-	fprintf(stderr, "{");
-	#define TEXTURE_PRINT(opt, fmt)  fprintf(stderr, "  " #opt ": %" fmt  "\n", opt);
-
-	/* TODO: use macros to print using PRIu ## type_size. */
-	TEXTURE_PRINT(tparam->width, PRIu32);
-	TEXTURE_PRINT(tparam->height, PRIu32);
-
-	TEXTURE_PRINT(tparam->seed, PRIu16);
-	TEXTURE_PRINT(tparam->octaves, PRIu16);
-	TEXTURE_PRINT(tparam->frequency, PRIu16);
-	TEXTURE_PRINT(tparam->persistence_num, PRIu8);
-	TEXTURE_PRINT(tparam->persistence_den, PRIu8);
-
-	TEXTURE_PRINT(tparam->threshold_red, PRIu8);
-	TEXTURE_PRINT(tparam->threshold_green, PRIu8);
-	TEXTURE_PRINT(tparam->threshold_blue, PRIu8);
-	TEXTURE_PRINT(tparam->color1.red, PRIu8);
-	TEXTURE_PRINT(tparam->color1.green, PRIu8);
-	TEXTURE_PRINT(tparam->color1.blue, PRIu8);
-	TEXTURE_PRINT(tparam->color2.red, PRIu8);
-	TEXTURE_PRINT(tparam->color2.green, PRIu8);
-	TEXTURE_PRINT(tparam->color2.blue, PRIu8);
-	TEXTURE_PRINT(tparam->color3.red, PRIu8);
-	TEXTURE_PRINT(tparam->color3.green, PRIu8);
-	TEXTURE_PRINT(tparam->color3.blue, PRIu8);
-
-	TEXTURE_PRINT(tparam->smoothing, PRIu8);
-
-	fprintf(stderr, "}");
-}
-
-/**
- * First we make sure the file length is correct, then we make sure the sequence
- * of READ_OPT does not go beyond the file length by testing against remmem.
- */
-int read_opt(qstring *s, texture_parameter *tparam) {
-	if (s->length != TEXTURE_FILE_SIZE) {
+/* Render the files listed one per line in 'list', or in stdin for "-". */
+int render_list(const char *list, const render_options *opt) {
+	FILE *file = strcmp(list, "-") == 0 ? stdin : fopen(list, "r");
+	if (file == NULL) {
+		trace("Could not open file:");
+		trace(list);
 		return EXIT_FAILURE;
 	}
 
-	unsigned long remmem = TEXTURE_FILE_SIZE;
-	const char *buf = s->val;
-
-	/* This macro comes in very handy to read argument one after another. */
-	#define READ_OPT(opt) \
-		if (sizeof (opt) > remmem) { return EXIT_FAILURE; } \
-		memcpy(&(opt), buf, sizeof (opt)); \
-		remmem -= sizeof (opt); \
-		buf += sizeof (opt);
-
-	READ_OPT(tparam->width);
-	READ_OPT(tparam->height);
-	READ_OPT(tparam->seed);
-	READ_OPT(tparam->octaves);
-	READ_OPT(tparam->frequency);
-	READ_OPT(tparam->persistence_num);
-	READ_OPT(tparam->persistence_den);
-	READ_OPT(tparam->threshold_red);
-	READ_OPT(tparam->threshold_green);
-	READ_OPT(tparam->threshold_blue);
-	READ_OPT(tparam->color1.red);
-	READ_OPT(tparam->color1.green);
-	READ_OPT(tparam->color1.blue);
-	READ_OPT(tparam->color2.red);
-	READ_OPT(tparam->color2.green);
-	READ_OPT(tparam->color2.blue);
-	READ_OPT(tparam->color3.red);
-	READ_OPT(tparam->color3.green);
-	READ_OPT(tparam->color3.blue);
-	READ_OPT(tparam->smoothing);
-
-	/* buf[0] != '\0' should never happen. */
-	if (buf[0] != '\0' || remmem != 0) {
-		return EXIT_FAILURE;
+	int status = EXIT_SUCCESS;
+	char line[FILENAME_MAX];
+	while (fgets(line, sizeof line, file)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0') {
+			continue;
+		}
+		if (batch_render(line, opt) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+		}
 	}
 
-	return EXIT_SUCCESS;
+	if (file != stdin) {
+		fclose(file);
+	}
+	return status;
 }
 
 void usage(const char * cmdname) {
-	printf("%s FILE\n", cmdname);
+	printf("%s [OPTIONS] FILE...\n", cmdname);
+	printf("%s [OPTIONS] --serve SOCKET\n\n", cmdname);
+	puts("With several files, or with --batch, outputs are named after the input");
+	puts("files, e.g. wood_RGB.bmp for wood.ptx. Otherwise they are named");
+	puts("result_*.bmp. The extension depends on --format.\n");
+	puts("Options:");
+	puts("  -b, --batch LIST");
+	puts("                 Also render the files listed in LIST, one per line.");
+	puts("                 Use - to read the list from the standard input.");
+	puts("  -c, --cache[=DIR]");
+	puts("                 Keep the random, work and smoothed layers in memory, so");
+	puts("                 that textures which only differ in their colors or");
+	puts("                 smoothing reuse them. With DIR, layers are also saved");
+	puts("                 in DIR for later runs. Not used in streaming mode.");
+	puts("  -D, --serve SOCKET");
+	puts("                 Run as a daemon rendering the textures sent on the Unix");
+	puts("                 socket SOCKET, until interrupted. Threads and buffers");
+	puts("                 are kept from one texture to the next. See serve.c for");
+	puts("                 the protocol. The other options are the defaults of the");
+	puts("                 requests.");
+	puts("  -F, --format NAME");
+	puts("                 Format of the outputs: 'bmp' (default), 'pnm' for");
+	puts("                 binary PGM and PPM files, or 'raw' for the bare pixels,");
+	puts("                 1 byte per pixel in .gray files and RGB in .rgb files.");
+	puts("                 Lines are top-down in both.");
+	puts("  -f, --fixed    Interpolate and sum octaves with Q16 integer weights.");
+	puts("                 Output is the same on every compiler and architecture,");
+	puts("                 and differs by a few levels from the default.");
+	puts("  -g, --gaussian Smooth with an approximated Gaussian (three box");
+	puts("                 filters) instead of a single box filter.");
+	puts("  -H, --hugepages");
+	puts("                 Back the layers with transparent hugepages, which");
+	puts("                 speeds up big textures where the kernel allows it.");
+	puts("  -h, --help     Print this help.");
+	puts("  -j, --jobs N   Use N threads. Output does not depend on N.");
+	puts("  -m, --max-memory SIZE");
+	puts("                 Memory budget of the streaming mode, in bytes. K, M");
+	puts("                 and G suffixes are accepted. Implies --stream.");
+	puts("  -M, --mipmaps  Write the whole mipmap chain in every output: level 0");
+	puts("                 on the left, the next levels stacked on its right.");
+	puts("                 Not available in streaming mode.");
+	puts("  -n, --noise NAME");
+	puts("                 Noise of the octaves: 'value' (default) interpolates");
+	puts("                 a random layer, 'perlin' and 'simplex' are gradient");
+	puts("                 noises, smooth with fewer octaves and without random");
+	puts("                 layer. --rng does not apply to them.");
+	puts("  -o, --out LIST Comma-separated outputs to write, among gs, rgb, alt,");
+	puts("                 gs_smooth, rgb_smooth and alt_smooth (default: all).");
+	puts("                 Stages no requested output needs are skipped.");
+	puts("  -p, --paletted Write the grayscale BMP outputs with 8 bits per pixel");
+	puts("                 and a palette, a third of the size of 24-bit files.");
+	puts("  -R, --region X,Y,WIDTH,HEIGHT");
+	puts("                 Only render the window of the picture whose top-left");
+	puts("                 pixel is X,Y. Only the lattice points it depends on");
+	puts("                 are generated (see --rng). Implies --stream.");
+	puts("  -r, --rng NAME Random generator of the random layer: 'libc' (default)");
+	puts("                 uses rand(), 'hash' hashes the seed and coordinates,");
+	puts("                 which is parallel and does not depend on the libc.");
+	puts("  -S, --stats    Measure every stage: wall and CPU times, Mpixel/s,");
+	puts("                 bytes of layers allocated and peak RSS, as text on");
+	puts("                 stderr.");
+	puts("  -s, --stream   Render and write the outputs by bands of rows, without");
+	puts("                 keeping any full layer in memory. Output is the same.");
+	puts("  -T, --stats-format FORMAT");
+	puts("                 Format of --stats, which it implies: 'text' (default)");
+	puts("                 or 'json' for one JSON line per stage on stdout.");
+	puts("  -t, --frames N Render N frames of the texture moving in time, named");
+	puts("                 e.g. result_0007_RGB.bmp. The lattices get a time axis");
+	puts("                 and frame 0 is the texture with '--rng hash'. Not");
+	puts("                 available in streaming mode.");
+	puts("  -w, --wide     Sum octaves on a 32-bit accumulator. Slightly more");
+	puts("                 accurate, never wraps around, but the result differs");
+	puts("                 from the default 8-bit accumulation.");
 }
 
 int main(int argc, char **argv) {
-	if (argc < 2) {
-		usage(argv[0]);
-		return 0;
+	render_options opt = {0};
+	opt.max_memory = STREAM_DEFAULT_MEMORY;
+	opt.outputs = RESULT_DEFAULT;
+	opt.prefix = OUTPUT_PREFIX;
+
+	static const struct option long_options[] = {
+		{"batch", required_argument, NULL, 'b'},
+		{"cache", optional_argument, NULL, 'c'},
+		{"fixed", no_argument, NULL, 'f'},
+		{"format", required_argument, NULL, 'F'},
+		{"frames", required_argument, NULL, 't'},
+		{"gaussian", no_argument, NULL, 'g'},
+		{"help", no_argument, NULL, 'h'},
+		{"hugepages", no_argument, NULL, 'H'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"max-memory", required_argument, NULL, 'm'},
+		{"mipmaps", no_argument, NULL, 'M'},
+		{"noise", required_argument, NULL, 'n'},
+		{"out", required_argument, NULL, 'o'},
+		{"paletted", no_argument, NULL, 'p'},
+		{"region", required_argument, NULL, 'R'},
+		{"rng", required_argument, NULL, 'r'},
+		{"serve", required_argument, NULL, 'D'},
+		{"stats", no_argument, NULL, 'S'},
+		{"stats-format", required_argument, NULL, 'T'},
+		{"stream", no_argument, NULL, 's'},
+		{"wide", no_argument, NULL, 'w'},
+		{NULL, 0, NULL, 0}
+	};
+
+	unsigned int threads = 1;
+	int hugepages = 0;
+	const char *batch = NULL;
+	const char *socket_path = NULL;
+	int cache = 0;
+	const char *cache_directory = NULL;
+	render_stats stats = {0};
+
+	int c;
+	while ((c = getopt_long(argc, argv, "b:c::D:F:fgHhj:Mm:n:o:pR:r:ST:st:w", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'b':
+			batch = optarg;
+			break;
+		case 'c':
+			cache = 1;
+			cache_directory = optarg;
+			break;
+		case 'D':
+			socket_path = optarg;
+			break;
+		case 'F':
+			if (parse_key(optarg, format_keys, FORMAT_COUNT, &opt.format) ==
+				EXIT_FAILURE) {
+				trace("Invalid format.");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'f':
+			opt.fixed_point = 1;
+			break;
+		case 'g':
+			opt.gaussian_smoothing = 1;
+			break;
+		case 'H':
+			hugepages = 1;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		case 'j':
+		{
+			char *end;
+			long n = strtol(optarg, &end, 10);
+			if (*end != '\0' || n < 1) {
+				trace("Number of jobs must be a positive integer.");
+				return EXIT_FAILURE;
+			}
+			threads = n;
+			break;
+		}
+		case 'm':
+			if (parse_memory(optarg, &opt.max_memory) == EXIT_FAILURE) {
+				trace("Invalid memory size.");
+				return EXIT_FAILURE;
+			}
+			opt.stream = 1;
+			break;
+		case 'M':
+			opt.mipmaps = 1;
+			break;
+		case 'n':
+			if (parse_key(optarg, noise_keys, NOISE_COUNT, &opt.noise) ==
+				EXIT_FAILURE) {
+				trace("Unknown noise.");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'o':
+			if (parse_outputs(optarg, &opt.outputs) == EXIT_FAILURE) {
+				trace("Invalid output list.");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'p':
+			opt.paletted_gray = 1;
+			break;
+		case 'R':
+			if (parse_region(optarg, &opt.window) == EXIT_FAILURE) {
+				trace("Invalid region.");
+				return EXIT_FAILURE;
+			}
+			opt.stream = 1;
+			break;
+		case 'r':
+			if (strcmp(optarg, "libc") == 0) {
+				opt.rng = RNG_LIBC;
+			} else if (strcmp(optarg, "hash") == 0) {
+				opt.rng = RNG_HASH;
+			} else {
+				trace("Unknown random generator.");
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'S':
+			opt.stats = &stats;
+			break;
+		case 'T':
+			if (strcmp(optarg, "text") == 0) {
+				stats.format = STATS_TEXT;
+			} else if (strcmp(optarg, "json") == 0) {
+				stats.format = STATS_JSON;
+			} else {
+				trace("Unknown statistics format.");
+				return EXIT_FAILURE;
+			}
+			opt.stats = &stats;
+			break;
+		case 's':
+			opt.stream = 1;
+			break;
+		case 't':
+		{
+			char *end;
+			long n = strtol(optarg, &end, 10);
+			if (*end != '\0' || n < 1) {
+				trace("Number of frames must be a positive integer.");
+				return EXIT_FAILURE;
+			}
+			opt.frames = n;
+			break;
+		}
+		case 'w':
+			opt.wide_accumulator = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
 	}
 
-	FILE *file = NULL;
-	file = fopen(argv[1], "rb");
-	if (file == NULL) {
-		trace("Could not open file:");
-		trace(argv[1]);
+	if (socket_path && (optind < argc || batch)) {
+		trace("No texture file can be given with --serve.");
 		return EXIT_FAILURE;
 	}
-
-	fseek(file, 0, SEEK_END);
-	unsigned long file_size = ftell(file);
-	fseek(file, 0, SEEK_SET);
-
-	qstring file_buf;
-	if (qstring_init(&file_buf, file_size) == EXIT_FAILURE) {
-		perror(argv[1]);
-		fclose(file);
-		return EXIT_FAILURE;
+	if (optind >= argc && !batch && !socket_path) {
+		usage(argv[0]);
+		return 0;
 	}
-
-	fread(file_buf.val, 1, file_size, file);
-	fclose(file);
-
-	/* Texture parameters. */
-	texture_parameter tparam;
-	if (read_opt(&file_buf, &tparam) == EXIT_FAILURE) {
-		trace("Texture file is corrupted.");
-		qstring_free(&file_buf);
+	if (opt.mipmaps && opt.stream) {
+		trace("Mipmaps are not available in streaming mode.");
 		return EXIT_FAILURE;
 	}
-	qstring_free(&file_buf);
-
-	/* Print the details to output. */
-	texture_details(&tparam);
-
-
-
-	/* The base layer will contain our final result. */
-	trace("Init.");
-	layer base;
-
-	/* The base layer is empty at the beginning. It will be generated upon a
-	 * random layer. */
-	if (init_layer(&base, tparam.width) == EXIT_FAILURE) {
-		trace("Init layer failed.");
+	if (opt.frames && (opt.stream || socket_path)) {
+		trace("Frames are not available in streaming mode nor with --serve.");
 		return EXIT_FAILURE;
 	}
-
-	/* Transform base using Perlin algorithm upon a randomly generated layer. */
-	trace("Random layer.");
-	layer random_layer;
-	if (generate_random_layer(&random_layer, &base, tparam.seed) ==
-		EXIT_FAILURE) {
-		trace("Random layer failed.");
+	if (opt.frames && opt.noise != NOISE_VALUE) {
+		trace("Frames are only available with value noise.");
 		return EXIT_FAILURE;
 	}
-	save_bmp(&random_layer, OUTPUT_RANDOM);
 
-	trace("Work layer.");
-	if (tparam.persistence_den == 0) {
-		free_layer(&random_layer);
-		trace("Persistence denominator cannot be zero.");
-		return EXIT_FAILURE;
-	}
-	if (generate_work_layer
-			(tparam.frequency, tparam.octaves,
-		(double)tparam.persistence_num / tparam.persistence_den, &base,
-		&random_layer) == EXIT_FAILURE) {
-		free_layer(&random_layer);
-		trace("Work layer failed.");
+	opt.workers = pool_create(threads);
+	if (!opt.workers) {
+		trace("Could not create thread pool.");
 		return EXIT_FAILURE;
 	}
-	free_layer(&random_layer);
-
-	trace("GS.");
-	save_bmp(&base, OUTPUT_GS);
-	trace("RGB.");
-
-	save_bmp_rgb(&base, OUTPUT_RGB, tparam.threshold_red,
-		tparam.threshold_green, tparam.threshold_blue,
-		tparam.color1, tparam.color2, tparam.color3);
-
-	trace("Alt.");
-	save_bmp_alt(&base, OUTPUT_ALT, tparam.threshold_red, tparam.color1,
-		tparam.color2);
-
-	/* Smoothed version if option is non-zero. */
-	if (tparam.smoothing != 0) {
-		layer layer_smoothed;
-		if (smooth_layer(&layer_smoothed, tparam.smoothing, &base) ==
-			EXIT_FAILURE) {
-			trace("Smoothed layer failed.");
+
+	/* One thread pool and one arena for all the textures. */
+	layer_arena arena;
+	layer_arena_init(&arena, hugepages);
+	opt.arena = &arena;
+
+	if (cache) {
+		opt.cache = layer_cache_create(CACHE_DEFAULT_MEMORY, cache_directory);
+		if (!opt.cache) {
+			trace("Could not create layer cache.");
+			layer_arena_free(&arena);
+			pool_destroy(opt.workers);
 			return EXIT_FAILURE;
 		}
+	}
 
-		save_bmp(&layer_smoothed, OUTPUT_GS_SMOOTH);
-		save_bmp_rgb(&layer_smoothed, OUTPUT_RGB_SMOOTH,
-			tparam.threshold_red, tparam.threshold_green,
-			tparam.threshold_blue, tparam.color1, tparam.color2,
-			tparam.color3);
-		save_bmp_alt(&layer_smoothed, OUTPUT_ALT_SMOOTH,
-			tparam.threshold_red, tparam.color1, tparam.color2);
-
-		free_layer(&layer_smoothed);
+	int status = EXIT_SUCCESS;
+	if (socket_path) {
+		status = serve(socket_path, &opt);
+	} else if (!batch && optind == argc - 1) {
+		status = render_file(argv[optind], &opt);
+	} else {
+		/* Batch mode: a failed texture does not stop the others. */
+		for (; optind < argc; optind++) {
+			if (batch_render(argv[optind], &opt) == EXIT_FAILURE) {
+				status = EXIT_FAILURE;
+			}
+		}
+		if (batch && render_list(batch, &opt) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+		}
 	}
 
-	free_layer(&base);
-	return EXIT_SUCCESS;
+	layer_cache_destroy(opt.cache);
+	layer_arena_free(&arena);
+	pool_destroy(opt.workers);
+	return status;
 }
@@ -10,8 +10,8 @@ but other types can be defined when SPECIAL LINES are defined.
 */
 
 #include <stdlib.h>
-#include <SDL/SDL.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <errno.h>
 #include <inttypes.h>
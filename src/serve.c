@@ -0,0 +1,461 @@
+/*
+Copyright © 2013-2014 Pierre Neidhardt
+See LICENSE file for copyright and license details.
+*/
+
+/*
+Render daemon. It listens on a Unix socket and renders the textures sent by its
+clients, so that previews do not pay for the start of a process, the creation of
+the thread pool and the faulting of the layers on every texture.
+
+A request is 35 bytes:
+
+  - the 29 bytes of a ptx descriptor;
+  - the outputs to render, a mask of RESULT_BIT() on 4 bytes, little-endian.
+    0 selects the outputs of the command-line;
+  - the format of the outputs, one FORMAT_* byte;
+  - flags: with SERVE_FDS, the outputs are passed as file descriptors instead
+    of being sent on the socket.
+
+The response starts with a 64-byte header: the status (EXIT_SUCCESS or
+EXIT_FAILURE) and the mask of the outputs written, on 4 bytes each, then the
+size of every output in the order of RESULT_*, on 8 bytes each, 0 for those
+not written. All are little-endian. The outputs follow in the same order, or,
+with SERVE_FDS, come as SCM_RIGHTS descriptors along the header. Descriptors
+are read-only views of the buffers of the connection: they are overwritten by
+its next request, so clients copy or map them first.
+
+Every connection renders into its own memory files, one per output, created on
+its first request and reused by the next ones. The layer arena and the thread
+pool are shared by all. A connection may send any number of requests, one after
+the other. Requests are rendered one at a time, in the order they are completed
+on any connection. Connections are non-blocking: partial requests are buffered
+and responses are sent as the clients read them, so that a slow client never
+holds the others. Once a client starts a request, it has SERVE_TIMEOUT seconds
+to send the rest of it, and as long to read the response once it is rendered,
+or it is disconnected.
+*/
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "serve.h"
+
+#define SERVE_REQUEST_SIZE (TEXTURE_FILE_SIZE + 6)
+#define SERVE_HEADER_SIZE (8 + 8 * RESULT_COUNT)
+/* Connections kept at once. Further ones are closed right away. Each one holds
+ * two descriptors per output. */
+#define SERVE_CLIENTS 32
+#define SERVE_TIMEOUT 5
+
+/*
+State of a connection: the request being received, or the response being sent
+from 'header' and the files 'fds', which are passed to the client as 'readers'.
+*/
+typedef struct {
+	Uint8 request[SERVE_REQUEST_SIZE];
+	size_t received;
+	int sending;
+	Uint8 header[SERVE_HEADER_SIZE];
+	size_t header_sent;
+	/* Output being sent and its bytes sent. */
+	unsigned int output;
+	off_t offset;
+	unsigned int outputs;
+	off_t sizes[RESULT_COUNT];
+	int pass_fds;
+	int fds[RESULT_COUNT];
+	int readers[RESULT_COUNT];
+	/* Time by which the request or the response must be complete, see
+	 * serve_now(). */
+	double deadline;
+} serve_connection;
+
+/* Set by SIGINT and SIGTERM to stop the daemon. */
+static volatile sig_atomic_t serve_stop = 0;
+
+void serve_signal(int sig) {
+	(void)sig;
+	serve_stop = 1;
+}
+
+double serve_now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Milliseconds left until 'deadline' for poll(), rounded up. */
+int serve_timeout(double deadline) {
+	double left = deadline - serve_now();
+	return left <= 0 ? 0 : (int)(left * 1000) + 1;
+}
+
+void put_le(Uint8 *buf, Uint64 v, unsigned int size) {
+	unsigned int i;
+	for (i = 0; i < size; i++) {
+		buf[i] = v >> (8 * i);
+	}
+}
+
+Uint32 get_le32(const Uint8 *buf) {
+	return buf[0] | buf[1] << 8 | buf[2] << 16 | (Uint32)buf[3] << 24;
+}
+
+/* Render one request into the buffers 'fds'. Sizes of the outputs in 'sizes'. */
+int serve_render(const Uint8 *request, const int *fds,
+	const render_options *opt, unsigned int *outputs, off_t *sizes) {
+	char descriptor[TEXTURE_FILE_SIZE + 1];
+	qstring s = {descriptor, TEXTURE_FILE_SIZE};
+	texture_parameter tparam;
+	unsigned int r;
+
+	memcpy(descriptor, request, TEXTURE_FILE_SIZE);
+	descriptor[TEXTURE_FILE_SIZE] = '\0';
+	if (read_opt(&s, &tparam) == EXIT_FAILURE) {
+		trace("Texture descriptor is corrupted.");
+		return EXIT_FAILURE;
+	}
+
+	render_options request_opt = *opt;
+	request_opt.outputs = get_le32(request + TEXTURE_FILE_SIZE);
+	request_opt.format = request[TEXTURE_FILE_SIZE + 4];
+	request_opt.output_fds = fds;
+	if (request_opt.outputs == 0) {
+		request_opt.outputs = opt->outputs;
+	}
+	/* The random layer is only written by debug builds. */
+	if (request_opt.outputs & ~RESULT_DEFAULT ||
+		request_opt.format >= FORMAT_COUNT) {
+		trace("Invalid outputs or format.");
+		return EXIT_FAILURE;
+	}
+
+	int status = request_opt.stream ? stream_render(&tparam, &request_opt) :
+		render(&tparam, &request_opt);
+	if (status == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+
+	*outputs = request_opt.outputs;
+	for (r = 0; r < RESULT_COUNT; r++) {
+		struct stat st;
+		if (!(*outputs & RESULT_BIT(r))) {
+			continue;
+		}
+		if (fstat(fds[r], &st) == -1) {
+			perror("fstat");
+			return EXIT_FAILURE;
+		}
+		sizes[r] = st.st_size;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+Create the memory files of the outputs. 'readers' are read-only descriptors of
+the same files, which are the ones handed to the clients.
+*/
+int serve_buffers(int *fds, int *readers) {
+	char path[64];
+	unsigned int r;
+
+	for (r = 0; r < RESULT_COUNT; r++) {
+		fds[r] = readers[r] = -1;
+	}
+	for (r = 0; r < RESULT_COUNT; r++) {
+		fds[r] = memfd_create(result_keys[r], MFD_CLOEXEC);
+		if (fds[r] == -1) {
+			perror("memfd_create");
+			return EXIT_FAILURE;
+		}
+		snprintf(path, sizeof path, "/proc/self/fd/%d", fds[r]);
+		readers[r] = open(path, O_RDONLY | O_CLOEXEC);
+		if (readers[r] == -1) {
+			perror(path);
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+void serve_buffers_close(int *fds, int *readers) {
+	unsigned int r;
+	for (r = 0; r < RESULT_COUNT; r++) {
+		if (fds[r] != -1) {
+			close(fds[r]);
+		}
+		if (readers[r] != -1) {
+			close(readers[r]);
+		}
+	}
+}
+
+/* Send the start of the header along the descriptors of the outputs. */
+ssize_t serve_send_fds(int client, serve_connection *c) {
+	int passed[RESULT_COUNT];
+	unsigned int r, count = 0;
+
+	for (r = 0; r < RESULT_COUNT; r++) {
+		if (c->outputs & RESULT_BIT(r)) {
+			passed[count++] = c->readers[r];
+		}
+	}
+
+	char control[CMSG_SPACE(sizeof passed)];
+	struct iovec iov = {c->header, sizeof c->header};
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(count * sizeof (int));
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(count * sizeof (int));
+	memcpy(CMSG_DATA(cmsg), passed, count * sizeof (int));
+	return sendmsg(client, &msg, 0);
+}
+
+/*
+Send what the client can take of the response, without blocking. The response
+is complete when 'sending' is cleared. Returns EXIT_FAILURE when the client
+must be disconnected.
+*/
+int serve_send(int client, serve_connection *c) {
+	ssize_t n;
+
+	while (c->header_sent < sizeof c->header) {
+		if (c->header_sent == 0 && c->pass_fds && c->outputs != 0) {
+			n = serve_send_fds(client, c);
+		} else {
+			n = write(client, c->header + c->header_sent,
+				sizeof c->header - c->header_sent);
+		}
+		if (n == -1) {
+			return errno == EAGAIN || errno == EINTR ? EXIT_SUCCESS :
+				EXIT_FAILURE;
+		}
+		c->header_sent += n;
+	}
+
+	for (; c->output < RESULT_COUNT && !c->pass_fds; c->output++) {
+		unsigned int r = c->output;
+		if (!(c->outputs & RESULT_BIT(r))) {
+			continue;
+		}
+		while (c->offset < c->sizes[r]) {
+			n = sendfile(client, c->fds[r], &c->offset,
+				c->sizes[r] - c->offset);
+			if (n == -1) {
+				return errno == EAGAIN || errno == EINTR ? EXIT_SUCCESS :
+					EXIT_FAILURE;
+			}
+			if (n == 0) {
+				return EXIT_FAILURE;
+			}
+		}
+		c->offset = 0;
+	}
+	c->sending = 0;
+	return EXIT_SUCCESS;
+}
+
+/*
+Read what 'client' sent of its request. Once it is complete, render it and start
+sending the response. Returns EXIT_FAILURE when the client hung up or could not
+be answered, and must be disconnected.
+*/
+int serve_client(int client, serve_connection *c, const render_options *opt) {
+	unsigned int r;
+
+	ssize_t n = read(client, c->request + c->received,
+		sizeof c->request - c->received);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+		return EXIT_SUCCESS;
+	}
+	if (n <= 0) {
+		return EXIT_FAILURE;
+	}
+	if (c->received == 0) {
+		c->deadline = serve_now() + SERVE_TIMEOUT;
+	}
+	c->received += n;
+	if (c->received < sizeof c->request) {
+		return EXIT_SUCCESS;
+	}
+
+	if (c->fds[0] == -1 && serve_buffers(c->fds, c->readers) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	c->received = 0;
+	c->outputs = 0;
+	int status = serve_render(c->request, c->fds, opt, &c->outputs, c->sizes);
+	if (status == EXIT_FAILURE) {
+		c->outputs = 0;
+	}
+
+	memset(c->header, 0, sizeof c->header);
+	put_le(c->header, status, 4);
+	put_le(c->header + 4, c->outputs, 4);
+	for (r = 0; r < RESULT_COUNT; r++) {
+		if (c->outputs & RESULT_BIT(r)) {
+			put_le(c->header + 8 + 8 * r, c->sizes[r], 8);
+		}
+	}
+	c->pass_fds = c->request[TEXTURE_FILE_SIZE + 5] & SERVE_FDS;
+	c->header_sent = 0;
+	c->output = 0;
+	c->offset = 0;
+	c->sending = 1;
+	c->deadline = serve_now() + SERVE_TIMEOUT;
+	return serve_send(client, c);
+}
+
+/* Accept a non-blocking client. */
+int serve_accept(int server, struct pollfd *clients, serve_connection *conns,
+	nfds_t *count) {
+	unsigned int r;
+
+	int client = accept4(server, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client == -1) {
+		if (errno != EINTR && errno != ECONNABORTED) {
+			perror("accept");
+			return EXIT_FAILURE;
+		}
+		return EXIT_SUCCESS;
+	}
+	if (*count == SERVE_CLIENTS) {
+		trace("Too many clients.");
+		close(client);
+		return EXIT_SUCCESS;
+	}
+
+	serve_connection *c = &conns[*count];
+	c->received = 0;
+	c->sending = 0;
+	for (r = 0; r < RESULT_COUNT; r++) {
+		c->fds[r] = c->readers[r] = -1;
+	}
+	clients[*count].fd = client;
+	clients[*count].events = POLLIN;
+	clients[*count].revents = 0;
+	(*count)++;
+	return EXIT_SUCCESS;
+}
+
+int serve(const char *path, const render_options *opt) {
+	struct sockaddr_un addr = {0};
+	struct stat st;
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		trace("Socket path is too long.");
+		return EXIT_FAILURE;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* A socket left by a previous daemon is replaced, but nothing else. */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+
+	int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server == -1) {
+		perror("socket");
+		return EXIT_FAILURE;
+	}
+	if (bind(server, (struct sockaddr *)&addr, sizeof addr) == -1 ||
+		listen(server, SOMAXCONN) == -1) {
+		perror(path);
+		close(server);
+		return EXIT_FAILURE;
+	}
+
+	/* Signals interrupt poll() instead of restarting it. */
+	struct sigaction action = {0};
+	action.sa_handler = serve_signal;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The server comes first, then the clients. conns[k - 1] is the state of
+	 * polled[k]. */
+	struct pollfd polled[1 + SERVE_CLIENTS];
+	serve_connection conns[SERVE_CLIENTS];
+	nfds_t count = 0, k;
+	int status = EXIT_SUCCESS;
+	polled[0].fd = server;
+	polled[0].events = POLLIN;
+
+	while (status == EXIT_SUCCESS && !serve_stop) {
+		/* Wake up for the first request or response to time out. */
+		int timeout = -1;
+		for (k = 0; k < count; k++) {
+			serve_connection *c = &conns[k];
+			polled[k + 1].events = c->sending ? POLLOUT : POLLIN;
+			if (c->received > 0 || c->sending) {
+				int left = serve_timeout(c->deadline);
+				if (timeout == -1 || left < timeout) {
+					timeout = left;
+				}
+			}
+		}
+		if (poll(polled, 1 + count, timeout) == -1) {
+			if (errno != EINTR) {
+				perror("poll");
+				status = EXIT_FAILURE;
+			}
+			continue;
+		}
+
+		/* Backwards, so that a closed client is replaced by one which has
+		 * already been looked at. */
+		for (k = count; k > 0 && !serve_stop; k--) {
+			struct pollfd *p = &polled[k];
+			serve_connection *c = &conns[k - 1];
+			int done = EXIT_SUCCESS;
+			if ((c->received > 0 || c->sending) &&
+				serve_now() >= c->deadline) {
+				trace("Client timed out.");
+				done = EXIT_FAILURE;
+			} else if (p->revents & (POLLIN | POLLOUT | POLLHUP | POLLERR)) {
+				done = c->sending ? serve_send(p->fd, c) :
+					serve_client(p->fd, c, opt);
+			}
+			if (done == EXIT_FAILURE) {
+				close(p->fd);
+				serve_buffers_close(c->fds, c->readers);
+				*p = polled[count];
+				*c = conns[count - 1];
+				count--;
+			}
+		}
+
+		if (polled[0].revents & POLLIN) {
+			status = serve_accept(server, polled + 1, conns, &count);
+		}
+	}
+
+	for (k = 1; k <= count; k++) {
+		close(polled[k].fd);
+		serve_buffers_close(conns[k - 1].fds, conns[k - 1].readers);
+	}
+	close(server);
+	unlink(path);
+	return status;
+}
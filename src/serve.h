@@ -0,0 +1,20 @@
+/*
+Copyright © 2013-2014 Pierre Neidhardt
+See LICENSE file for copyright and license details.
+*/
+
+#ifndef SERVE_H
+#define SERVE_H 1
+
+#include "texture.h"
+
+/* Flags of a request, see serve.c for the protocol. */
+#define SERVE_FDS 0x1
+
+/*
+Render the requests of the clients of the Unix socket 'path' with the options
+'opt', until SIGINT or SIGTERM. The socket is removed on exit.
+*/
+int serve(const char *path, const render_options *opt);
+
+#endif /* SERVE_H */
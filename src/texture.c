@@ -0,0 +1,3735 @@
+/*
+Copyright © 2013-2014 Pierre Neidhardt
+See LICENSE file for copyright and license details.
+*/
+
+/*
+Texture engine: the layers of a procedural texture and the output files,
+from the texture parameters of a ptx file. It uses Perlin algorithm. See README
+for more details.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "cache.h"
+#include "config.h"
+#include "pool.h"
+#include "texture.h"
+
+/******************************************************************************/
+
+int qstring_init(qstring *s, unsigned long size) {
+	s->val = malloc(size);
+	if (s->val == NULL) {
+		perror("qstring_init");
+		return EXIT_FAILURE;
+	}
+	s->length = size;
+
+	return EXIT_SUCCESS;
+}
+
+void qstring_free(qstring *s) {
+	if (s->val != NULL) {
+		free(s->val);
+	}
+}
+
+/******************************************************************************/
+
+void trace(const char *s) {
+	fprintf(stderr, "==> %s\n", s);
+}
+
+double clock_seconds(clockid_t clock) {
+	struct timespec t;
+	clock_gettime(clock, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* Print 's' as a JSON string. */
+void json_string(FILE *file, const char *s) {
+	fputc('"', file);
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\') {
+			fprintf(file, "\\%c", *s);
+		} else if ((unsigned char)*s < 0x20) {
+			fprintf(file, "\\u%04x", (unsigned int)(unsigned char)*s);
+		} else {
+			fputc(*s, file);
+		}
+	}
+	fputc('"', file);
+}
+
+void stage_begin(const render_options *opt, const char *stage,
+	const char *description) {
+	trace(description);
+
+	render_stats *stats = opt->stats;
+	if (!stats) {
+		return;
+	}
+	stats->stage = stage;
+	stats->allocated = 0;
+	stats->cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+	stats->wall = clock_seconds(CLOCK_MONOTONIC);
+}
+
+void stage_end(const render_options *opt, tarea_t pixels) {
+	render_stats *stats = opt->stats;
+	if (!stats) {
+		return;
+	}
+
+	double wall = clock_seconds(CLOCK_MONOTONIC) - stats->wall;
+	double cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID) - stats->cpu;
+	double rate = wall > 0 ? pixels / wall / 1e6 : 0;
+
+	/* ru_maxrss is in kilobytes on Linux. */
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	if (stats->format == STATS_JSON) {
+		printf("{\"texture\": ");
+		json_string(stdout, stats->texture ? stats->texture : "");
+		printf(", \"stage\": \"%s\", \"wall_s\": %.6f, \"cpu_s\": %.6f, "
+			"\"pixels\": %llu, \"mpixel_per_s\": %.3f, "
+			"\"allocated_bytes\": %llu, \"peak_rss_kb\": %ld}\n",
+			stats->stage, wall, cpu, (unsigned long long)pixels, rate,
+			(unsigned long long)stats->allocated, usage.ru_maxrss);
+		fflush(stdout);
+	} else {
+		fprintf(stderr, "    %s: %.3f s, CPU %.3f s, %.1f Mpixel/s, "
+			"%.1f MiB allocated, peak RSS %.1f MiB\n", stats->stage, wall, cpu,
+			rate, stats->allocated / 1048576.0, usage.ru_maxrss / 1024.0);
+	}
+}
+
+/******************************************************************************/
+
+/*
+Returns a value between 0 and max inclusive.
+*/
+unsigned long randomgen(unsigned long max) {
+	return (unsigned long)((((double)rand()) / RAND_MAX) * max);
+}
+
+/*
+Returns a value between 0 and max inclusive. Must be run the first time with
+a seed, then without a seed.
+
+In this home-made random, we use the following recursive sequence to generate
+random values:
+
+        random_number = ( factor * random_number + offset ) % max
+
+We need to match the following properties to have a decent RNG.
+
+- Offset and max must be coprime
+- If 4 divides max , then factor % 4 == 1
+- For all p dividing max, factor % p == 1
+
+Besides,
+
+- offset must be "small" compared to max;
+- factor must be close to the square root of max.
+*/
+unsigned long custom_randomgen(unsigned long max, unsigned long seed) {
+	static unsigned long random_number = 0;
+	if (seed != 0) {
+		random_number = seed;
+		return random_number;
+	}
+
+	unsigned long factor = RANDOMGEN_FACTOR, offset = RANDOMGEN_OFFSET;
+
+	random_number = (factor * random_number + offset) % max;
+	return random_number;
+}
+
+/* Account new layer memory in the statistics of the stage. */
+void stats_allocated(const render_options *opt, tarea_t bytes) {
+	if (opt->stats) {
+		opt->stats->allocated += bytes;
+	}
+}
+
+/*
+Layers of the arena are aligned on pages, or on hugepages so that every big
+layer starts on one. They are handed out and given back like a stack: a render
+releases its layers in the reverse order, so that the arena is empty again at
+its end. A layer released out of order is only reclaimed by the next reset.
+*/
+#define ARENA_PAGE 4096
+#define ARENA_HUGEPAGE (2 * 1024 * 1024)
+
+tarea_t arena_size(const layer_arena *a, tsize_t width, tsize_t height) {
+	tarea_t align = a->hugepages ? ARENA_HUGEPAGE : ARENA_PAGE;
+	return ((tarea_t)width * height + align - 1) & ~(align - 1);
+}
+
+void layer_arena_init(layer_arena *a, int hugepages) {
+	a->base = NULL;
+	a->reserved = 0;
+	a->used = 0;
+	a->touched = 0;
+	a->hugepages = hugepages;
+}
+
+void layer_arena_free(layer_arena *a) {
+	if (a->base) {
+		munmap(a->base, a->reserved);
+	}
+	layer_arena_init(a, a->hugepages);
+}
+
+/*
+Replace the reservation by one of 'size' bytes. Pages are only backed once
+touched. For hugepages, we reserve one more hugepage to align the start, and
+unmap what is left on both sides.
+*/
+int layer_arena_reserve(layer_arena *a, tarea_t size) {
+	tarea_t extra = a->hugepages ? ARENA_HUGEPAGE : 0;
+
+	layer_arena_free(a);
+	Uint8 *p = mmap(NULL, size + extra, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (p == MAP_FAILED) {
+		return EXIT_FAILURE;
+	}
+
+	if (a->hugepages) {
+		tarea_t head = (ARENA_HUGEPAGE - (uintptr_t)p % ARENA_HUGEPAGE) %
+			ARENA_HUGEPAGE;
+		if (head > 0) {
+			munmap(p, head);
+		}
+		if (extra - head > 0) {
+			munmap(p + head + size, extra - head);
+		}
+		p += head;
+#ifdef MADV_HUGEPAGE
+		madvise(p, size, MADV_HUGEPAGE);
+#endif
+	}
+
+	a->base = p;
+	a->reserved = size;
+	return EXIT_SUCCESS;
+}
+
+/*
+O(1) unless the reservation must grow. If it cannot, layers fall back to the
+heap.
+*/
+void layer_arena_reset(layer_arena *a, tsize_t width, tsize_t height,
+	unsigned int layers) {
+	tarea_t size = layers * arena_size(a, width, height);
+	a->used = 0;
+	if (size > a->reserved) {
+		layer_arena_reserve(a, size);
+	}
+}
+
+/* Every stage writes all the pixels of its layers, so they are not cleared. */
+int layer_acquire(layer *l, tsize_t width, tsize_t height,
+	const render_options *opt) {
+	layer_arena *a = opt->arena;
+
+	l->width = width;
+	l->height = height;
+
+	if (a && a->reserved - a->used >= arena_size(a, width, height)) {
+		l->v = a->base + a->used;
+		a->used += arena_size(a, width, height);
+		if (a->used > a->touched) {
+			stats_allocated(opt, a->used - a->touched);
+			a->touched = a->used;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	stats_allocated(opt, (tarea_t)width * height);
+	l->v = malloc((tarea_t)width * (tarea_t)height);
+	if (!l->v) {
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+void layer_release(layer *l, const render_options *opt) {
+	layer_arena *a = opt->arena;
+
+	if (!a || !l->v || l->v < a->base || l->v >= a->base + a->reserved) {
+		free(l->v);
+	} else if (l->v + arena_size(a, l->width, l->height) ==
+		a->base + a->used) {
+		a->used = l->v - a->base;
+	}
+	l->v = NULL;
+}
+
+Uint8 *at_layer(layer *l, tsize_t i, tsize_t j) {
+	return &(l->v[(tarea_t)i * (tarea_t)l->height + (tarea_t)j]);
+}
+
+/*
+Stages are split into bands of rows processed by the worker pool. Every band
+writes to its own rows only, so the result depends neither on the number of
+threads nor on the scheduling. We use a few bands per thread so that work
+stealing can balance the load.
+*/
+#define BAND_MIN_ROWS 16
+#define BANDS_PER_THREAD 4
+
+tsize_t band_rows(tsize_t rows, const render_options *opt) {
+	unsigned int threads = pool_threads(opt->workers);
+	if (threads == 1) {
+		return rows == 0 ? 1 : rows;
+	}
+
+	tsize_t bands = threads * BANDS_PER_THREAD;
+	tsize_t band = (rows + bands - 1) / bands;
+	return band < BAND_MIN_ROWS ? BAND_MIN_ROWS : band;
+}
+
+unsigned long band_count(tsize_t rows, tsize_t band) {
+	return (rows + band - 1) / band;
+}
+
+
+/*
+Colorizers turn a layer value into a color. 'param' holds the colors and
+thresholds.
+*/
+typedef void (*colorizer)(const void *param, Uint8 value, Uint8 *red,
+	Uint8 *green, Uint8 *blue);
+
+/*
+Layer values are only 8-bit, so the colorizer is evaluated once per value into
+a palette of pixels in the channel order of the output file, blue first if
+'bgr' is set. Coloring a layer is then a table lookup per pixel, whatever the
+cost of the colorizer.
+*/
+#define PALETTE_SIZE 256
+
+void palette_init(Uint8 (*palette)[3], colorizer colorize, const void *param,
+	int bgr) {
+	unsigned int value;
+	for (value = 0; value < PALETTE_SIZE; value++) {
+		Uint8 *p = palette[value];
+		if (bgr) {
+			colorize(param, value, &p[2], &p[1], &p[0]);
+		} else {
+			colorize(param, value, &p[0], &p[1], &p[2]);
+		}
+	}
+}
+
+/* Grayscale: we provide 3 times the same value. */
+void color_gs(const void *param, Uint8 value, Uint8 *red, Uint8 *green,
+	Uint8 *blue) {
+	(void)param;
+	*red = *green = *blue = value;
+}
+
+/*
+In the whole program layers are encoded in grayscale. To add colors, we use the
+three colors and thresholds provided as argument.
+*/
+void color_rgb(const void *param, Uint8 value, Uint8 *red, Uint8 *green,
+	Uint8 *blue) {
+	const rgb_param *c = param;
+	double f;
+
+	if (value < c->threshold_red) {
+		*red = c->color1.red;
+		*green = c->color1.green;
+		*blue = c->color1.blue;
+	} else if (value < c->threshold_green) {
+		f = (double)(value - c->threshold_red) / (c->threshold_green -
+			c->threshold_red);
+		*red = (c->color1.red * (1 - f) + c->color2.red * (f));
+		*green = (c->color1.green * (1 - f) + c->color2.green * (f));
+		*blue = (c->color1.blue * (1 - f) + c->color2.blue * (f));
+	} else if (value < c->threshold_blue) {
+		f = (double)(value - c->threshold_green) / (c->threshold_blue -
+			c->threshold_green);
+		*red = (c->color2.red * (1 - f) + c->color3.red * (f));
+		*green = (c->color2.green * (1 - f) + c->color3.green * (f));
+		*blue = (c->color2.blue * (1 - f) + c->color3.blue * (f));
+	} else {
+		*red = c->color3.red;
+		*green = c->color3.green;
+		*blue = c->color3.blue;
+	}
+}
+
+/*
+Same as color_rgb but with cosine interpolation for colors. Result is more
+"liquid". Note the mirrored value around threshold/2. This is what gives the
+wave effect.
+*/
+void color_alt(const void *param, Uint8 v, Uint8 *red, Uint8 *green,
+	Uint8 *blue) {
+	const alt_param *c = param;
+	Uint8 threshold = c->threshold;
+
+	double value = fmod(v, threshold);
+	if (value > threshold / 2) {
+		value = threshold - value;
+	}
+
+	double f = (1 - cos(M_PI * value / (threshold / 2))) / 2;
+
+	*red = c->color1.red * (1 - f) + c->color2.red * f;
+	*green = c->color1.green * (1 - f) + c->color2.green * f;
+	*blue = c->color1.blue * (1 - f) + c->color2.blue * f;
+}
+
+const char *result_keys[RESULT_COUNT] = {
+	"random", "gs", "rgb", "alt", "gs_smooth", "rgb_smooth", "alt_smooth"
+};
+
+const char *result_files[RESULT_COUNT] = {
+	OUTPUT_RANDOM, OUTPUT_GS, OUTPUT_RGB, OUTPUT_ALT,
+	OUTPUT_GS_SMOOTH, OUTPUT_RGB_SMOOTH, OUTPUT_ALT_SMOOTH
+};
+
+void color_param_init(color_param *c, const texture_parameter *tparam) {
+	rgb_param rgb = {
+		tparam->threshold_red, tparam->threshold_green, tparam->threshold_blue,
+		tparam->color1, tparam->color2, tparam->color3
+	};
+	alt_param alt = { tparam->threshold_red, tparam->color1, tparam->color2 };
+	c->rgb = rgb;
+	c->alt = alt;
+}
+
+void result_colorizer(unsigned int result, const color_param *c,
+	colorizer *colorize, const void **param) {
+	switch (result) {
+	case RESULT_RGB:
+	case RESULT_RGB_SMOOTH:
+		*colorize = color_rgb;
+		*param = &c->rgb;
+		break;
+	case RESULT_ALT:
+	case RESULT_ALT_SMOOTH:
+		*colorize = color_alt;
+		*param = &c->alt;
+		break;
+	default:
+		*colorize = color_gs;
+		*param = NULL;
+		break;
+	}
+}
+
+/*
+Output drivers. A file is a header followed by the lines of the picture, top-down
+or bottom-up. The depth of a file is in bytes per pixel: 1 for a grayscale
+output written as such, 3 otherwise, in the channel order of the driver.
+
+BMP files are written without SDL, in the format SDL_SaveBMP() produces for our
+surfaces: 24 bits per pixel, no compression, lines padded to 4 bytes and stored
+bottom-up. Grayscale outputs may also be written with 8 bits per pixel and a
+palette of the 256 grays, which is a third of the size.
+
+PNM files are binary PGM (P5) for the grayscale outputs and PPM (P6) for the
+others. Raw files hold the pixels only, in the same order: their size must be
+known to read them.
+*/
+typedef struct {
+	const char *gray_extension;
+	const char *color_extension;
+	/* Depth of the grayscale outputs, unless --paletted is given. */
+	unsigned int gray_depth;
+	/* Lines are padded to 4 bytes, stored bottom-up, in blue, green, red
+	 * order. */
+	int padded;
+	int bottom_up;
+	int bgr;
+	/* Size of the header. It is also written to 'header' if not NULL. */
+	tarea_t (*header)(Uint8 *header, tsize_t width, tsize_t height,
+		unsigned int depth);
+} output_driver;
+
+#define BMP_HEADER_SIZE 54
+
+/* Upper bound of the size of the headers. */
+#define OUTPUT_HEADER_MAX (BMP_HEADER_SIZE + PALETTE_SIZE * 4)
+
+void put_le16(Uint8 *buf, Uint16 v) {
+	buf[0] = v & 0xff;
+	buf[1] = v >> 8;
+}
+
+void put_le32(Uint8 *buf, Uint32 v) {
+	buf[0] = v & 0xff;
+	buf[1] = (v >> 8) & 0xff;
+	buf[2] = (v >> 16) & 0xff;
+	buf[3] = v >> 24;
+}
+
+tarea_t bmp_header(Uint8 *header, tsize_t width, tsize_t height,
+	unsigned int depth) {
+	tarea_t offset = BMP_HEADER_SIZE + (depth == 1 ? PALETTE_SIZE * 4 : 0);
+	tarea_t image = (((tarea_t)width * depth + 3) & ~(tarea_t)3) * height;
+	unsigned int value;
+
+	if (!header) {
+		return offset;
+	}
+
+	memset(header, 0, offset);
+	header[0] = 'B';
+	header[1] = 'M';
+	put_le32(header + 2, offset + image);
+	put_le32(header + 10, offset);
+	put_le32(header + 14, 40);
+	put_le32(header + 18, width);
+	put_le32(header + 22, height);
+	put_le16(header + 26, 1);
+	put_le16(header + 28, depth * 8);
+	put_le32(header + 34, image);
+	if (depth == 1) {
+		put_le32(header + 46, PALETTE_SIZE);
+		for (value = 0; value < PALETTE_SIZE; value++) {
+			memset(header + BMP_HEADER_SIZE + value * 4, value, 3);
+		}
+	}
+	return offset;
+}
+
+tarea_t pnm_header(Uint8 *header, tsize_t width, tsize_t height,
+	unsigned int depth) {
+	char buf[OUTPUT_HEADER_MAX];
+	int length = snprintf(buf, sizeof buf, "P%c\n%lu %lu\n255\n",
+			depth == 1 ? '5' : '6', (unsigned long)width,
+			(unsigned long)height);
+	if (header) {
+		memcpy(header, buf, length);
+	}
+	return length;
+}
+
+tarea_t raw_header(Uint8 *header, tsize_t width, tsize_t height,
+	unsigned int depth) {
+	(void)header;
+	(void)width;
+	(void)height;
+	(void)depth;
+	return 0;
+}
+
+const char *format_keys[FORMAT_COUNT] = { "bmp", "pnm", "raw" };
+
+const char *noise_keys[NOISE_COUNT] = { "value", "perlin", "simplex" };
+
+const output_driver output_drivers[FORMAT_COUNT] = {
+	{ "bmp", "bmp", 3, 1, 1, 1, bmp_header },
+	{ "pgm", "ppm", 1, 0, 0, 0, pnm_header },
+	{ "gray", "rgb", 1, 0, 0, 0, raw_header }
+};
+
+int result_gray(unsigned int result) {
+	return result == RESULT_RANDOM || result == RESULT_GS ||
+		result == RESULT_GS_SMOOTH;
+}
+
+unsigned int result_depth(unsigned int result, const render_options *opt) {
+	if (!result_gray(result)) {
+		return 3;
+	}
+	return opt->paletted_gray ? 1 : output_drivers[opt->format].gray_depth;
+}
+
+/* File name of an output in 'buf', of length FILENAME_MAX. */
+int result_file(char *buf, unsigned int result, const render_options *opt) {
+	const output_driver *d = &output_drivers[opt->format];
+	int length = snprintf(buf, FILENAME_MAX, "%s%s.%s", opt->prefix,
+			result_files[result],
+			result_gray(result) ? d->gray_extension : d->color_extension);
+	if (length < 0 || length >= FILENAME_MAX) {
+		trace("Output file name is too long.");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+Open the file of an output, empty, and its name in 'filename' of length
+FILENAME_MAX. When the options have descriptors for the outputs, the one of the
+output is duplicated instead, so that it can be closed like a file.
+*/
+int output_open(char *filename, unsigned int result, int flags,
+	const render_options *opt) {
+	int fd;
+
+	if (result_file(filename, result, opt) == EXIT_FAILURE) {
+		return -1;
+	}
+	if (!opt->output_fds) {
+		fd = open(filename, flags | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1) {
+			perror(filename);
+		}
+		return fd;
+	}
+
+	fd = dup(opt->output_fds[result]);
+	if (fd == -1 || ftruncate(fd, 0) == -1) {
+		perror(filename);
+		if (fd != -1) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+/* Where the lines of a picture are in its file. */
+typedef struct {
+	tsize_t height;
+	unsigned int depth;
+	int bottom_up;
+	/* Size of the header, i.e. offset of the first line in the file. */
+	tarea_t offset;
+	tarea_t pitch;
+	/* Size of the file. */
+	tarea_t size;
+} output_layout;
+
+void output_layout_init(output_layout *l, const output_driver *d,
+	tsize_t width, tsize_t height, unsigned int depth) {
+	l->height = height;
+	l->depth = depth;
+	l->bottom_up = d->bottom_up;
+	l->offset = d->header(NULL, width, height, depth);
+	l->pitch = (tarea_t)width * depth;
+	if (d->padded) {
+		l->pitch = (l->pitch + 3) & ~(tarea_t)3;
+	}
+	l->size = l->offset + l->pitch * height;
+}
+
+/* Offset of the picture line y, from the top, in the file. */
+tarea_t output_line_offset(const output_layout *l, tsize_t y) {
+	tsize_t line = l->bottom_up ? l->height - 1 - y : y;
+	return l->offset + (tarea_t)line * l->pitch;
+}
+
+/*
+Output file mapped in memory: pixels are written in place and the kernel writes
+them back, without any intermediate picture. The space is allocated when the
+file is opened, so that a full disk is reported there rather than by a signal
+when writing to the mapping. Padding is zeroed.
+*/
+typedef struct {
+	int fd;
+	Uint8 *map;
+	output_layout layout;
+} output_map;
+
+int output_map_open(output_map *m, unsigned int result, tsize_t width,
+	tsize_t height, const render_options *opt) {
+	const output_driver *d = &output_drivers[opt->format];
+	unsigned int depth = result_depth(result, opt);
+	char filename[FILENAME_MAX];
+	output_layout_init(&m->layout, d, width, height, depth);
+
+	m->fd = output_open(filename, result, O_RDWR, opt);
+	if (m->fd == -1) {
+		return EXIT_FAILURE;
+	}
+
+	int error = posix_fallocate(m->fd, 0, m->layout.size);
+	if (error != 0) {
+		errno = error;
+		perror(filename);
+		close(m->fd);
+		return EXIT_FAILURE;
+	}
+
+	m->map = mmap(NULL, m->layout.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			m->fd, 0);
+	if (m->map == MAP_FAILED) {
+		perror(filename);
+		close(m->fd);
+		return EXIT_FAILURE;
+	}
+
+	d->header(m->map, width, height, depth);
+	return EXIT_SUCCESS;
+}
+
+/* Line y of the picture, from the top. */
+Uint8 *output_map_line(const output_map *m, tsize_t y) {
+	return m->map + output_line_offset(&m->layout, y);
+}
+
+int output_map_close(output_map *m) {
+	int status = EXIT_SUCCESS;
+	if (munmap(m->map, m->layout.size) == -1) {
+		perror("munmap");
+		status = EXIT_FAILURE;
+	}
+	if (close(m->fd) == -1) {
+		perror("close");
+		status = EXIT_FAILURE;
+	}
+	return status;
+}
+
+/* Write pixels from 'begin' to 'end' excluded of a line through 'palette'. */
+void color_line(Uint8 *line, unsigned int depth, const Uint8 (*palette)[3],
+	const Uint8 *v, tarea_t stride, tsize_t begin, tsize_t end) {
+	tsize_t i;
+
+	if (depth == 1) {
+		for (i = begin; i < end; i++) {
+			line[i] = palette[v[i * stride]][0];
+		}
+		return;
+	}
+	for (i = begin; i < end; i++) {
+		memcpy(line + (tarea_t)i * 3, palette[v[i * stride]], 3);
+	}
+}
+
+/*
+All the outputs of a layer are written in a single pass: every band of the
+layer is read once, and written through the palette of each requested output
+while it is in cache.
+*/
+typedef struct {
+	unsigned int count;
+	output_map files[RESULT_COUNT];
+	Uint8 palettes[RESULT_COUNT][PALETTE_SIZE][3];
+} output_set;
+
+typedef struct {
+	output_set *set;
+	layer *l;
+	tsize_t band;
+} output_job;
+
+/*
+Layer rows are picture columns. We walk the band line by line so that writes
+to the files are contiguous, while the band of the layer we read from stays in
+cache.
+*/
+int output_band(void *data, unsigned long index) {
+	output_job *job = data;
+	output_set *set = job->set;
+	tsize_t width = job->l->width, height = job->l->height;
+	tsize_t j;
+	tsize_t begin = index * job->band;
+	tsize_t end = width - begin < job->band ? width : begin + job->band;
+	unsigned int k;
+
+	for (j = 0; j < height; j++) {
+		const Uint8 *v = at_layer(job->l, 0, j);
+		for (k = 0; k < set->count; k++) {
+			color_line(output_map_line(&set->files[k], j),
+				set->files[k].layout.depth,
+				(const Uint8 (*)[3])set->palettes[k], v, height, begin, end);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+With mipmaps, every output holds the whole mipmap chain in one picture, the
+atlas. Level 0 is on the left, and the next levels are stacked top-down on its
+right. Each level is half the size of the previous one, rounded down, and each
+of its pixels is the mean of the 2x2 pixels of the previous level, per channel.
+Levels are computed from the colors and not from the layer, since colorizers
+are not linear. The atlas is the mapped file itself: the next levels are read
+back from it.
+*/
+typedef struct {
+	output_map *atlas;
+	tsize_t band;
+	/* Level 0. */
+	layer *l;
+	const Uint8 (*palette)[3];
+	/* Next levels. */
+	region src;
+	region dst;
+} mipmap_job;
+
+/* Level 0: picture lines from the band. */
+int mipmap_color_band(void *data, unsigned long index) {
+	mipmap_job *job = data;
+	tsize_t width = job->l->width, height = job->l->height;
+	tsize_t y;
+	tsize_t begin = index * job->band;
+	tsize_t end = height - begin < job->band ? height : begin + job->band;
+
+	for (y = begin; y < end; y++) {
+		color_line(output_map_line(job->atlas, y), job->atlas->layout.depth,
+			job->palette, at_layer(job->l, 0, y), height, 0, width);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int mipmap_level_band(void *data, unsigned long index) {
+	mipmap_job *job = data;
+	const region *src = &job->src, *dst = &job->dst;
+	unsigned int depth = job->atlas->layout.depth;
+	tsize_t x, y;
+	unsigned int c;
+	tsize_t begin = index * job->band;
+	tsize_t end = dst->height - begin < job->band ? dst->height :
+		begin + job->band;
+	/* A side of 1 pixel is not halved: its pixel is counted twice. */
+	tarea_t right = src->width > 1 ? depth : 0;
+
+	for (y = begin; y < end; y++) {
+		tsize_t y2 = src->height > 1 ? src->y + 2 * y + 1 : src->y + 2 * y;
+		const Uint8 *line1 = output_map_line(job->atlas, src->y + 2 * y) +
+			(tarea_t)src->x * depth;
+		const Uint8 *line2 = output_map_line(job->atlas, y2) +
+			(tarea_t)src->x * depth;
+		Uint8 *out = output_map_line(job->atlas, dst->y + y) +
+			(tarea_t)dst->x * depth;
+		for (x = 0; x < (tarea_t)dst->width * depth; x += depth) {
+			for (c = 0; c < depth; c++) {
+				out[x + c] = (line1[2 * x + c] + line1[2 * x + right + c] +
+					line2[2 * x + c] + line2[2 * x + right + c] + 2) / 4;
+			}
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/* Next level of the chain. A side of 1 pixel stays 1 pixel long. */
+void mipmap_next(const region *level, region *next) {
+	next->width = level->width > 1 ? level->width / 2 : 1;
+	next->height = level->height > 1 ? level->height / 2 : 1;
+}
+
+int save_mipmaps(layer *current_layer, unsigned int result,
+	colorizer colorize, const void *param, const render_options *opt) {
+	const output_driver *d = &output_drivers[opt->format];
+	region level = { 0, 0, current_layer->width, current_layer->height };
+	region next = { current_layer->width, 0, 0, 0 };
+
+	/* The stacked levels are as wide as level 1, and may be higher than level
+	 * 0 when it is much wider than high. */
+	tsize_t width = level.width, height = level.height, stacked = 0;
+	region r = level;
+	while (r.width > 1 || r.height > 1) {
+		mipmap_next(&r, &r);
+		if (stacked == 0) {
+			width += r.width;
+		}
+		stacked += r.height;
+	}
+	if (stacked > height) {
+		height = stacked;
+	}
+
+	Uint8 palette[PALETTE_SIZE][3];
+	palette_init(palette, colorize, param, d->bgr);
+
+	/* The area below the levels stays black. */
+	output_map atlas;
+	if (output_map_open(&atlas, result, width, height, opt) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+
+	mipmap_job job;
+	job.atlas = &atlas;
+	job.l = current_layer;
+	job.palette = (const Uint8 (*)[3])palette;
+	job.band = band_rows(current_layer->height, opt);
+	pool_run(opt->workers, band_count(current_layer->height, job.band),
+		mipmap_color_band, &job);
+
+	while (level.width > 1 || level.height > 1) {
+		mipmap_next(&level, &next);
+		job.src = level;
+		job.dst = next;
+		job.band = band_rows(next.height, opt);
+		pool_run(opt->workers, band_count(next.height, job.band),
+			mipmap_level_band, &job);
+
+		level = next;
+		next.y += next.height;
+	}
+
+	return output_map_close(&atlas);
+}
+
+/*
+Write the outputs from 'first' to 'last' requested in 'opt' for the layer.
+*/
+int save_results(layer *current_layer, unsigned int first, unsigned int last,
+	const color_param *colors, const render_options *opt) {
+	if (opt->mipmaps) {
+		unsigned int r;
+		int status = EXIT_SUCCESS;
+		for (r = first; r <= last; r++) {
+			colorizer colorize;
+			const void *param;
+			if (!(opt->outputs & RESULT_BIT(r))) {
+				continue;
+			}
+			result_colorizer(r, colors, &colorize, &param);
+			if (save_mipmaps(current_layer, r, colorize, param, opt) ==
+				EXIT_FAILURE) {
+				status = EXIT_FAILURE;
+			}
+		}
+		return status;
+	}
+
+	const output_driver *d = &output_drivers[opt->format];
+	output_set set;
+	unsigned int r, k;
+	int status = EXIT_SUCCESS;
+
+	set.count = 0;
+	for (r = first; r <= last; r++) {
+		if (!(opt->outputs & RESULT_BIT(r))) {
+			continue;
+		}
+
+		if (output_map_open(&set.files[set.count], r, current_layer->width,
+				current_layer->height, opt) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+			break;
+		}
+
+		colorizer colorize;
+		const void *param;
+		result_colorizer(r, colors, &colorize, &param);
+		palette_init(set.palettes[set.count], colorize, param, d->bgr);
+		set.count++;
+	}
+
+	if (status == EXIT_SUCCESS && set.count != 0) {
+		output_job job = {
+			&set, current_layer, band_rows(current_layer->width, opt)
+		};
+		pool_run(opt->workers, band_count(current_layer->width, job.band),
+			output_band, &job);
+	}
+
+	for (k = 0; k < set.count; k++) {
+		if (output_map_close(&set.files[k]) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+		}
+	}
+
+	return status;
+}
+
+/*
+Using cubic splines. We use a cubic polinom p(x) = a + b*x + c*x^2 + d*x^3 so
+that
+
+        p(0) = y1
+        p(1) = y2
+        p'(0) = 0
+        p'(1) = 0
+
+We want the border to be smooth, hence the flat tangent. The uniq resulting
+polynom is
+
+        p(x) = y1 [ 3 * (1-x)^2 - 2 (1-x)^3 ] + y2 [ 3*x^2 -2*x^3 ]
+
+Here x is delta / step. delta is the distance to y1, step is the distance
+between y1 and y2. We normalize everything to [0,1] to get the previous
+property.
+
+The interpolated value is then y1 * fac1 + y2 * fac2. The factors only depend
+on delta and step, so we compute them once per octave, see spline_init().
+ */
+void interpol_factors(tsize_t step, tsize_t delta, double *fac1, double *fac2) {
+	/* step == 0 should never happen. */
+	if (step == 0) {
+		*fac1 = 1;
+		*fac2 = 0;
+		return;
+	}
+	if (step == 1) {
+		*fac1 = 0;
+		*fac2 = 1;
+		return;
+	}
+
+	double a = (double)1 - (double)delta / step;
+	double b = (double)delta / step;
+
+	*fac1 = 3 * (a * a) - 2 * (a * a * a);
+	*fac2 = 3 * (b * b) - 2 * (b * b * b);
+
+	/* Linear interpolation. Unused. */
+	/*
+	   *fac1 = 1 - (double)delta / step;
+	   *fac2 = (double)delta / step;
+	 */
+}
+
+/*
+Interpolation factors for every delta in [0, step[. All the pixels of an octave
+share the same step, so this table replaces the divisions and cubic terms we
+would otherwise compute three times per pixel.
+
+In fixed-point mode the factors are also stored in Q16. fac2 is rounded and
+fac1 is its complement, so that they add up to exactly 1: an interpolated value
+never exceeds its bounds, and the products of two 8-bit values fit in 32 bits.
+
+When the step is a power of two 2^k, delta / step is a dyadic fraction and the
+factors are computed without any rounding: they are integers divided by 2^3k.
+So are y1 * fac1 + y2 * fac2 and its sum as long as 3k + 8 bits fit in the
+mantissa of a double. The spline is then evaluated on integers with a shift,
+with the very same result as the floating-point evaluation. This covers every
+step up to SPLINE_EXACT_STEP, above which we fall back to the doubles.
+*/
+#define SPLINE_EXACT_SHIFT 14
+#define SPLINE_EXACT_STEP ((tsize_t)1 << SPLINE_EXACT_SHIFT)
+
+typedef struct {
+	tsize_t step;
+	double *fac1;
+	double *fac2;
+	/* Q16 factors, only in fixed-point mode. */
+	Uint32 *q1;
+	Uint32 *q2;
+	/* Factors times step^3 and 3k, only for power-of-two steps 2^k. */
+	Uint64 *e1;
+	Uint64 *e2;
+	unsigned int shift;
+} spline;
+
+void spline_free(spline *s) {
+	free(s->fac1);
+	free(s->fac2);
+	free(s->q1);
+	free(s->q2);
+	free(s->e1);
+	free(s->e2);
+}
+
+int is_power_of_two(tsize_t n) {
+	return n != 0 && (n & (n - 1)) == 0;
+}
+
+unsigned int log2_floor(tsize_t n) {
+	unsigned int k = 0;
+	while (n >>= 1) {
+		k++;
+	}
+	return k;
+}
+
+int spline_init(spline *s, tsize_t step, int fixed_point) {
+	tsize_t delta;
+	int exact = !fixed_point && is_power_of_two(step) &&
+		step <= SPLINE_EXACT_STEP;
+
+	s->step = step;
+	s->fac1 = malloc(step * sizeof (double));
+	s->fac2 = malloc(step * sizeof (double));
+	s->q1 = NULL;
+	s->q2 = NULL;
+	s->e1 = NULL;
+	s->e2 = NULL;
+	s->shift = 3 * log2_floor(step);
+	if (fixed_point) {
+		s->q1 = malloc(step * sizeof (Uint32));
+		s->q2 = malloc(step * sizeof (Uint32));
+	}
+	if (exact) {
+		s->e1 = malloc(step * sizeof (Uint64));
+		s->e2 = malloc(step * sizeof (Uint64));
+	}
+	if (!s->fac1 || !s->fac2 || (fixed_point && (!s->q1 || !s->q2)) ||
+		(exact && (!s->e1 || !s->e2))) {
+		spline_free(s);
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+
+	for (delta = 0; delta < step; delta++) {
+		interpol_factors(step, delta, &(s->fac1[delta]), &(s->fac2[delta]));
+		if (fixed_point) {
+			s->q2[delta] = s->fac2[delta] * 65536 + 0.5;
+			s->q1[delta] = 65536 - s->q2[delta];
+		}
+		if (exact) {
+			s->e1[delta] = ldexp(s->fac1[delta], s->shift);
+			s->e2[delta] = ldexp(s->fac2[delta], s->shift);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+Row pass: interpolate the lattice points of 'src' along the row, for the
+columns from 'begin' to 'end' excluded. Bound values are the two lattice points
+surrounding each pixel. The last cell is clamped to the border of the layer.
+'src' is indexed by column and 'dest' from 'begin'.
+
+The result goes through a 'long' before being stored in a Uint8 so that the
+rounding is the same as a direct evaluation of the spline. The fixed-point
+and exact results are truncated as well.
+*/
+void interpol_row(Uint8 *dest, const Uint8 *src, tsize_t length,
+	tsize_t begin, tsize_t end, const spline *s) {
+	tsize_t bound1, bound2, delta, first, last;
+
+	bound1 = s->e1 ? begin & ~(s->step - 1) : begin / s->step * s->step;
+	for (; bound1 < end;
+		bound1 += s->step) {
+		bound2 = bound1 + s->step;
+		if (bound2 >= length) {
+			bound2 = length - 1;
+		}
+
+		long y1 = src[bound1];
+		long y2 = src[bound2];
+
+		first = bound1 < begin ? begin - bound1 : 0;
+		last = end - bound1 < s->step ? end - bound1 : s->step;
+		if (s->q1) {
+			for (delta = first; delta < last; delta++) {
+				dest[bound1 + delta - begin] =
+					(y1 * s->q1[delta] + y2 * s->q2[delta]) >> 16;
+			}
+			continue;
+		}
+		if (s->e1) {
+			for (delta = first; delta < last; delta++) {
+				dest[bound1 + delta - begin] = ((Uint64)y1 * s->e1[delta] +
+					(Uint64)y2 * s->e2[delta]) >> s->shift;
+			}
+			continue;
+		}
+		for (delta = first; delta < last; delta++) {
+			dest[bound1 + delta - begin] =
+				(long)(y1 * s->fac1[delta] + y2 * s->fac2[delta]);
+		}
+	}
+}
+
+/* Column pass: blend two interpolated lattice rows with the same factors. */
+void interpol_column(Uint8 *dest, const Uint8 *row1, const Uint8 *row2,
+	tsize_t size, double fac1, double fac2) {
+	tsize_t j;
+	for (j = 0; j < size; j++) {
+		dest[j] = (long)((long)row1[j] * fac1 + (long)row2[j] * fac2);
+	}
+}
+
+void interpol_column_fixed(Uint8 *dest, const Uint8 *row1, const Uint8 *row2,
+	tsize_t size, Uint32 q1, Uint32 q2) {
+	tsize_t j;
+	for (j = 0; j < size; j++) {
+		dest[j] = (row1[j] * q1 + row2[j] * q2) >> 16;
+	}
+}
+
+void interpol_column_exact(Uint8 *dest, const Uint8 *row1, const Uint8 *row2,
+	tsize_t size, Uint64 e1, Uint64 e2, unsigned int shift) {
+	tsize_t j;
+	if (shift <= 24) {
+		/* Steps up to 256: 32-bit products. */
+		Uint32 f1 = e1, f2 = e2;
+		for (j = 0; j < size; j++) {
+			dest[j] = (row1[j] * f1 + row2[j] * f2) >> shift;
+		}
+		return;
+	}
+	for (j = 0; j < size; j++) {
+		dest[j] = (row1[j] * e1 + row2[j] * e2) >> shift;
+	}
+}
+
+/* Column pass at 'delta' of the spline, with the kernel of its mode. */
+void interpol_blend(Uint8 *dest, const Uint8 *row1, const Uint8 *row2,
+	tsize_t size, const spline *s, tsize_t delta) {
+	if (s->q1) {
+		interpol_column_fixed(dest, row1, row2, size, s->q1[delta],
+			s->q2[delta]);
+		return;
+	}
+	if (s->e1) {
+		interpol_column_exact(dest, row1, row2, size, s->e1[delta],
+			s->e2[delta], s->shift);
+		return;
+	}
+	interpol_column(dest, row1, row2, size, s->fac1[delta], s->fac2[delta]);
+}
+
+/*
+Counter-based generator: the value at (i, j) is a hash of the seed and of the
+coordinates. Any point can thus be computed on its own, in any order, and the
+result does not depend on the C library. The mixer is 'lowbias32' by Chris
+Wellons. The golden ratio spreads consecutive columns before mixing, and the
+row is folded in the key.
+*/
+#define HASH_GOLDEN 0x9e3779b9u
+
+Uint32 hash32(Uint32 x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+Uint32 hash_key(Uint32 seed, tsize_t i) {
+	return hash32(seed ^ hash32(i + HASH_GOLDEN));
+}
+
+/*
+Random values of row i, from column 'begin' on, in 'dest'. With GCC vector
+extensions, four columns are hashed at once.
+*/
+#ifdef __GNUC__
+typedef Uint32 hash_vector __attribute__ ((vector_size (16)));
+#define HASH_LANES 4
+
+hash_vector hash32_lanes(hash_vector x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+#endif
+
+void hash_row(Uint8 *dest, Uint32 seed, tsize_t i, tsize_t begin,
+	tsize_t count) {
+	Uint32 key = hash_key(seed, i);
+	tsize_t j = 0;
+
+#ifdef HASH_LANES
+	const hash_vector lanes = { 0, 1, 2, 3 };
+	unsigned int k;
+	for (; j + HASH_LANES <= count; j += HASH_LANES) {
+		hash_vector x = hash32_lanes((lanes + (begin + j)) * HASH_GOLDEN ^
+			key);
+		for (k = 0; k < HASH_LANES; k++) {
+			dest[j + k] = x[k] >> 24;
+		}
+	}
+#endif
+
+	for (; j < count; j++) {
+		dest[j] = hash32((begin + j) * HASH_GOLDEN ^ key) >> 24;
+	}
+}
+
+/*
+Gradient noise. Instead of interpolating random values, the lattice points get
+random gradients, and a pixel sums the ramps of the gradients around it: the
+four corners of its cell blended with a quintic fade (Perlin), or the three
+corners of its triangle in the skewed grid, each fading with the distance
+(simplex). Gradients are the four diagonals, hashed from the seed and the
+lattice point like the hash generator, so no random layer is generated and any
+pixel is computed on its own. Both hide the lattice with fewer octaves than
+value noise.
+
+Cells are as large as with value noise, 'side / frequency' pixels, and the
+noise on [-1, 1] is mapped to 0..255. Lattice coordinates of the columns are
+computed once per octave, exactly, from integers. Rows are evaluated on
+NOISE_LANES columns at once where the compiler has vector conversions; the
+scalar path does the same float operations in the same order.
+*/
+typedef struct {
+	int noise;
+	Uint32 seed;
+	Uint16 frequency;
+	tsize_t side;
+	/* Lattice cell of every column from 'begin' on, offset in it and fade. */
+	Uint32 *cell;
+	float *offset;
+	float *fade;
+} gradient;
+
+/* Skew factors of the simplex grid, (sqrt(3) - 1) / 2 and (3 - sqrt(3)) / 6. */
+#define SIMPLEX_F2 0.36602540378f
+#define SIMPLEX_G2 0.21132486540f
+
+float noise_fade(float t) {
+	return t * t * t * (t * (t * 6 - 15) + 10);
+}
+
+/* Cell and offset of pixel 'x' along an axis. */
+void gradient_coord(const gradient *g, tsize_t x, Uint32 *cell,
+	float *offset) {
+	tarea_t position = (tarea_t)x * g->frequency;
+	*cell = position / g->side;
+	*offset = (float)(position % g->side) / g->side;
+}
+
+int gradient_init(gradient *g, int noise, Uint32 seed, Uint16 frequency,
+	tsize_t side, tsize_t begin, tsize_t end) {
+	tsize_t j;
+
+	g->noise = noise;
+	g->seed = seed;
+	g->frequency = frequency;
+	g->side = side;
+	g->cell = malloc((end - begin) * sizeof (Uint32));
+	g->offset = malloc((end - begin) * sizeof (float));
+	g->fade = malloc((end - begin) * sizeof (float));
+	if (!g->cell || !g->offset || !g->fade) {
+		free(g->cell);
+		free(g->offset);
+		free(g->fade);
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+
+	for (j = begin; j < end; j++) {
+		gradient_coord(g, j, &g->cell[j - begin], &g->offset[j - begin]);
+		g->fade[j - begin] = noise_fade(g->offset[j - begin]);
+	}
+	return EXIT_SUCCESS;
+}
+
+void gradient_free(gradient *g) {
+	free(g->cell);
+	free(g->offset);
+	free(g->fade);
+}
+
+/* Dot product of the gradient of hash 'h' with (x, y): its top bits flip
+ * the signs. */
+float gradient_dot(Uint32 h, float x, float y) {
+	union { float f; Uint32 u; } a = { x }, b = { y };
+	a.u ^= h & 0x80000000u;
+	b.u ^= (h << 1) & 0x80000000u;
+	return a.f + b.f;
+}
+
+Uint8 gradient_value(float n) {
+	float v = n * 127.5f + 128;
+	return v > 255 ? 255 : v < 0 ? 0 : (Uint8)v;
+}
+
+float perlin_point(Uint32 key1, Uint32 key2, float x, float fade_x, Uint32 cell,
+	float y, float fade_y) {
+	Uint32 c1 = cell * HASH_GOLDEN, c2 = (cell + 1) * HASH_GOLDEN;
+	float n11 = gradient_dot(hash32(c1 ^ key1), x, y);
+	float n12 = gradient_dot(hash32(c2 ^ key1), x, y - 1);
+	float n21 = gradient_dot(hash32(c1 ^ key2), x - 1, y);
+	float n22 = gradient_dot(hash32(c2 ^ key2), x - 1, y - 1);
+	float a = n11 + fade_y * (n12 - n11);
+	float b = n21 + fade_y * (n22 - n21);
+	return a + fade_x * (b - a);
+}
+
+/* Ramp of a simplex corner at (x, y), whose gradient has hash 'h'. */
+float simplex_corner(Uint32 h, float x, float y) {
+	float t = 0.5f - x * x - y * y;
+	if (t < 0) {
+		return 0;
+	}
+	t *= t;
+	return t * t * gradient_dot(h, x, y);
+}
+
+float simplex_point(Uint32 seed, float x, float y) {
+	float s = (x + y) * SIMPLEX_F2;
+	/* Coordinates are not negative: truncation is the floor. */
+	Uint32 i = x + s, j = y + s;
+	float t = (float)(i + j) * SIMPLEX_G2;
+	float x0 = x - ((float)i - t), y0 = y - ((float)j - t);
+	Uint32 i1 = x0 > y0, j1 = 1 - i1;
+	float x1 = x0 - (float)i1 + SIMPLEX_G2, y1 = y0 - (float)j1 + SIMPLEX_G2;
+	float x2 = x0 - 1 + 2 * SIMPLEX_G2, y2 = y0 - 1 + 2 * SIMPLEX_G2;
+	float n = simplex_corner(hash32(j * HASH_GOLDEN ^ hash_key(seed, i)),
+			x0, y0) +
+		simplex_corner(hash32((j + j1) * HASH_GOLDEN ^ hash_key(seed, i + i1)),
+			x1, y1) +
+		simplex_corner(hash32((j + 1) * HASH_GOLDEN ^ hash_key(seed, i + 1)),
+			x2, y2);
+	return 70 * n;
+}
+
+#if defined(HASH_LANES) && defined(__has_builtin)
+#if __has_builtin(__builtin_convertvector)
+#define NOISE_LANES HASH_LANES
+#endif
+#endif
+
+#ifdef NOISE_LANES
+typedef float noise_vector __attribute__ ((vector_size (16)));
+
+noise_vector gradient_dot_lanes(hash_vector h, noise_vector x,
+	noise_vector y) {
+	hash_vector a = (hash_vector)x ^ (h & 0x80000000u);
+	hash_vector b = (hash_vector)y ^ ((h << 1) & 0x80000000u);
+	return (noise_vector)a + (noise_vector)b;
+}
+
+void gradient_value_lanes(Uint8 *dest, noise_vector n) {
+	noise_vector v = n * 127.5f + 128;
+	unsigned int k;
+	for (k = 0; k < NOISE_LANES; k++) {
+		dest[k] = v[k] > 255 ? 255 : v[k] < 0 ? 0 : (Uint8)v[k];
+	}
+}
+
+noise_vector simplex_corner_lanes(hash_vector h, noise_vector x,
+	noise_vector y) {
+	noise_vector t = 0.5f - x * x - y * y;
+	t = (noise_vector)((hash_vector)t & (hash_vector)(t >= 0));
+	t *= t;
+	return t * t * gradient_dot_lanes(h, x, y);
+}
+#endif
+
+/* Row i of the octave, 'count' columns from the first one of the tables. */
+void gradient_row(const gradient *g, tsize_t i, Uint8 *dest, tsize_t count) {
+	tsize_t j = 0;
+	Uint32 row_cell;
+	float x;
+	gradient_coord(g, i, &row_cell, &x);
+
+	if (g->noise == NOISE_PERLIN) {
+		Uint32 key1 = hash_key(g->seed, row_cell);
+		Uint32 key2 = hash_key(g->seed, row_cell + 1);
+		float fade_x = noise_fade(x);
+#ifdef NOISE_LANES
+		noise_vector x1 = (noise_vector){ 0 } + x, x2 = x1 - 1;
+		for (; j + NOISE_LANES <= count; j += NOISE_LANES) {
+			hash_vector cell, c1, c2;
+			noise_vector y, fade_y;
+			memcpy(&cell, g->cell + j, sizeof cell);
+			memcpy(&y, g->offset + j, sizeof y);
+			memcpy(&fade_y, g->fade + j, sizeof fade_y);
+			c1 = cell * HASH_GOLDEN;
+			c2 = (cell + 1) * HASH_GOLDEN;
+			noise_vector n11 = gradient_dot_lanes(hash32_lanes(c1 ^ key1), x1,
+				y);
+			noise_vector n12 = gradient_dot_lanes(hash32_lanes(c2 ^ key1), x1,
+				y - 1);
+			noise_vector n21 = gradient_dot_lanes(hash32_lanes(c1 ^ key2), x2,
+				y);
+			noise_vector n22 = gradient_dot_lanes(hash32_lanes(c2 ^ key2), x2,
+				y - 1);
+			noise_vector a = n11 + fade_y * (n12 - n11);
+			noise_vector b = n21 + fade_y * (n22 - n21);
+			gradient_value_lanes(dest + j, a + fade_x * (b - a));
+		}
+#endif
+		for (; j < count; j++) {
+			dest[j] = gradient_value(perlin_point(key1, key2, x, fade_x,
+				g->cell[j], g->offset[j], g->fade[j]));
+		}
+		return;
+	}
+
+	x += row_cell;
+#ifdef NOISE_LANES
+	for (; j + NOISE_LANES <= count; j += NOISE_LANES) {
+		hash_vector cell;
+		noise_vector y;
+		memcpy(&cell, g->cell + j, sizeof cell);
+		memcpy(&y, g->offset + j, sizeof y);
+		y += __builtin_convertvector(cell, noise_vector);
+
+		noise_vector s = (x + y) * SIMPLEX_F2;
+		hash_vector ci = __builtin_convertvector(x + s, hash_vector);
+		hash_vector cj = __builtin_convertvector(y + s, hash_vector);
+		noise_vector t = __builtin_convertvector(ci + cj, noise_vector) *
+			SIMPLEX_G2;
+		noise_vector x0 = x - (__builtin_convertvector(ci, noise_vector) - t);
+		noise_vector y0 = y - (__builtin_convertvector(cj, noise_vector) - t);
+		hash_vector i1 = (hash_vector)(x0 > y0) & 1, j1 = 1 - i1;
+		noise_vector x1 = x0 - __builtin_convertvector(i1, noise_vector) +
+			SIMPLEX_G2;
+		noise_vector y1 = y0 - __builtin_convertvector(j1, noise_vector) +
+			SIMPLEX_G2;
+		noise_vector x2 = x0 - 1 + 2 * SIMPLEX_G2;
+		noise_vector y2 = y0 - 1 + 2 * SIMPLEX_G2;
+		noise_vector n =
+			simplex_corner_lanes(hash32_lanes(cj * HASH_GOLDEN ^
+				hash32_lanes(g->seed ^ hash32_lanes(ci + HASH_GOLDEN))),
+				x0, y0) +
+			simplex_corner_lanes(hash32_lanes((cj + j1) * HASH_GOLDEN ^
+				hash32_lanes(g->seed ^ hash32_lanes(ci + i1 + HASH_GOLDEN))),
+				x1, y1) +
+			simplex_corner_lanes(hash32_lanes((cj + 1) * HASH_GOLDEN ^
+				hash32_lanes(g->seed ^ hash32_lanes(ci + 1 + HASH_GOLDEN))),
+				x2, y2);
+		gradient_value_lanes(dest + j, 70 * n);
+	}
+#endif
+	for (; j < count; j++) {
+		dest[j] = gradient_value(simplex_point(g->seed, x,
+			(float)g->cell[j] + g->offset[j]));
+	}
+}
+
+/*
+Random rows are read through a source, so that the random layer need not be
+fully in memory. 'row' returns row i of the random layer, indexed by column:
+only the lattice points of the octave reading it, from column 'begin' to 'end'
+excluded, need to be valid. 'buf' is a row the source may use to store the
+result. The random layer has 'width' rows of 'height' columns, like layers.
+
+With a gradient noise, there are no rows: the octave hashes its gradients from
+'seed', see gradient_source().
+*/
+typedef struct {
+	const Uint8 *(*row)(void *data, tsize_t i, tsize_t begin, tsize_t end,
+		Uint8 *buf);
+	void *data;
+	tsize_t width;
+	tsize_t height;
+	/* One of the NOISE_* values. */
+	int noise;
+	Uint32 seed;
+} random_source;
+
+const Uint8 *layer_source_row(void *data, tsize_t i, tsize_t begin,
+	tsize_t end, Uint8 *buf) {
+	(void)begin;
+	(void)end;
+	(void)buf;
+	return at_layer(data, i, 0);
+}
+
+random_source layer_source(layer *l) {
+	random_source src = { layer_source_row, l, l->width, l->height, 0, 0 };
+	return src;
+}
+
+/* Source of octave n with a gradient noise. Every octave has its own seed. */
+random_source gradient_source(tsize_t width, tsize_t height, Uint16 n,
+	Uint32 seed, const render_options *opt) {
+	random_source src = {
+		NULL, NULL, width, height, opt->noise, seed ^ hash32(n * HASH_GOLDEN)
+	};
+	return src;
+}
+
+/*
+An octave of frequency 'frequency' built upon the random layer. The grid is
+computed upon the frequency and the longer side of the layer, so that its cells
+are square whatever the shape of the layer. Rows are produced one at
+a time by octave_row(): the two lattice rows bounding the current cell are
+interpolated once (row pass) and kept, then every pixel row of the cell is a
+blend of them (column pass). The bottom row of a cell is the top row of the next
+one, so each lattice row is interpolated only once when rows are requested in
+order.
+
+If the step is null, i.e. the frequency is higher than the side, every pixel is
+a lattice point and the octave is the random layer itself.
+
+Only the columns from 'begin' to 'end' excluded are produced, and only the
+lattice points they depend on are read from the source.
+*/
+typedef struct {
+	random_source src;
+	tsize_t step;
+	tsize_t begin;
+	tsize_t end;
+	/* Columns read from the source, end excluded. */
+	tsize_t src_begin;
+	tsize_t src_end;
+	spline s;
+	/* Interpolated lattice rows and their index in 'src'. */
+	Uint8 *row1;
+	Uint8 *row2;
+	tsize_t bound1;
+	tsize_t bound2;
+	/* Random row for the source. */
+	Uint8 *buf;
+	/* Only with a gradient noise, which replaces all of the above. */
+	gradient g;
+} octave;
+
+tsize_t octave_step(tsize_t width, tsize_t height, Uint16 frequency) {
+	tsize_t side = width > height ? width : height;
+	return frequency == 0 ? 0 : side / frequency;
+}
+
+int octave_init(octave *o, random_source src, Uint16 frequency,
+	tsize_t begin, tsize_t end, int fixed_point) {
+	tsize_t step = octave_step(src.width, src.height, frequency);
+	o->src = src;
+	o->step = step;
+	o->begin = begin;
+	o->end = end;
+	o->row1 = NULL;
+	o->row2 = NULL;
+
+	if (src.noise != NOISE_VALUE) {
+		return gradient_init(&o->g, src.noise, src.seed, frequency,
+			src.width > src.height ? src.width : src.height, begin, end);
+	}
+
+	o->buf = malloc(src.height * sizeof (Uint8));
+	if (!o->buf) {
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+
+	if (step == 0) {
+		o->src_begin = begin;
+		o->src_end = end;
+		return EXIT_SUCCESS;
+	}
+
+	o->src_begin = begin / step * step;
+	o->src_end = ((end - 1) / step + 1) * step;
+	o->src_end = o->src_end >= src.height ? src.height : o->src_end + 1;
+
+	if (spline_init(&(o->s), step, fixed_point) == EXIT_FAILURE) {
+		free(o->buf);
+		return EXIT_FAILURE;
+	}
+
+	o->row1 = malloc((end - begin) * sizeof (Uint8));
+	o->row2 = malloc((end - begin) * sizeof (Uint8));
+	if (!o->row1 || !o->row2) {
+		free(o->row1);
+		free(o->row2);
+		free(o->buf);
+		spline_free(&(o->s));
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+
+	/* No cached row yet. */
+	o->bound1 = o->bound2 = src.width;
+
+	return EXIT_SUCCESS;
+}
+
+void octave_free(octave *o) {
+	if (o->src.noise != NOISE_VALUE) {
+		gradient_free(&o->g);
+		return;
+	}
+	free(o->buf);
+	if (o->step == 0) {
+		return;
+	}
+	free(o->row1);
+	free(o->row2);
+	spline_free(&(o->s));
+}
+
+const Uint8 *octave_source_row(octave *o, tsize_t i) {
+	return o->src.row(o->src.data, i, o->src_begin, o->src_end, o->buf);
+}
+
+/* Write row i of the octave to 'dest', from column 'begin' on. */
+void octave_row(octave *o, tsize_t i, Uint8 *dest) {
+	tsize_t width = o->src.width, height = o->src.height;
+
+	if (o->src.noise != NOISE_VALUE) {
+		gradient_row(&o->g, i, dest, o->end - o->begin);
+		return;
+	}
+	if (o->step == 0) {
+		memcpy(dest, octave_source_row(o, i) + o->begin, o->end - o->begin);
+		return;
+	}
+
+	tsize_t bound1 = o->s.e1 ? i & ~(o->step - 1) : i / o->step * o->step;
+	if (bound1 != o->bound1) {
+		tsize_t bound2 = bound1 + o->step;
+		if (bound2 >= width) {
+			bound2 = width - 1;
+		}
+
+		if (bound1 == o->bound2) {
+			/* The previous bottom row is the current top row. */
+			Uint8 *swap = o->row1;
+			o->row1 = o->row2;
+			o->row2 = swap;
+		} else {
+			interpol_row(o->row1, octave_source_row(o, bound1), height,
+				o->begin, o->end, &(o->s));
+		}
+		interpol_row(o->row2, octave_source_row(o, bound2), height, o->begin,
+			o->end, &(o->s));
+
+		o->bound1 = bound1;
+		o->bound2 = bound2;
+	}
+
+	interpol_blend(dest, o->row1, o->row2, o->end - o->begin, &(o->s),
+		i - bound1);
+}
+
+/*
+Random source for octaves with the counter-based generator. Nothing is stored:
+only the lattice points of the octave, every 'step' column and the last one,
+are evaluated. A step below 2 means that every point is read.
+*/
+typedef struct {
+	Uint32 seed;
+	/* Length of the rows. */
+	tsize_t height;
+	tsize_t step;
+} hash_rng;
+
+const Uint8 *hash_source_row(void *data, tsize_t i, tsize_t begin,
+	tsize_t end, Uint8 *buf) {
+	const hash_rng *rng = data;
+	tsize_t j;
+
+	if (rng->step < 2) {
+		hash_row(buf + begin, rng->seed, i, begin, end - begin);
+		return buf;
+	}
+
+	Uint32 key = hash_key(rng->seed, i);
+	j = (begin + rng->step - 1) / rng->step * rng->step;
+	for (; j < end && j < rng->height - 1; j += rng->step) {
+		buf[j] = hash32(j * HASH_GOLDEN ^ key) >> 24;
+	}
+	if (end == rng->height) {
+		buf[end - 1] = hash32((end - 1) * HASH_GOLDEN ^ key) >> 24;
+	}
+	return buf;
+}
+
+typedef struct {
+	layer *random_layer;
+	Uint32 seed;
+	tsize_t band;
+} random_job;
+
+int random_band(void *data, unsigned long index) {
+	random_job *job = data;
+	tsize_t width = job->random_layer->width;
+	tsize_t i;
+	tsize_t begin = index * job->band;
+	tsize_t end = width - begin < job->band ? width : begin + job->band;
+
+	for (i = begin; i < end; i++) {
+		hash_row(at_layer(job->random_layer, i, 0), job->seed, i, 0,
+			job->random_layer->height);
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int generate_random_layer(layer *random_layer, tsize_t width, tsize_t height,
+	Uint32 seed, const render_options *opt) {
+	/* Values are only on 0..255, so it's gray scale. We add colors only when we
+	 * save/render the picture. */
+	tsize_t i, j;
+
+	if (layer_acquire(random_layer, width, height, opt) == EXIT_FAILURE) {
+		trace("Could not init random layer.");
+		return EXIT_FAILURE;
+	}
+
+	if (opt->rng == RNG_HASH) {
+		random_job job = { random_layer, seed, band_rows(width, opt) };
+		return pool_run(opt->workers, band_count(width, job.band), random_band,
+				&job);
+	}
+
+	/* Init seeds for both std and home-made RNG. We do not use the home-made
+	 * RNG here. The sequence of rand() calls is what defines the texture, so
+	 * this stage cannot be split among threads. */
+	srand(seed);
+	/* custom_randomgen (0, seed); */
+	for (i = 0; i < width; i++) {
+		for (j = 0; j < height; j++) {
+			/* random_layer->v[i][j] = custom_randomgen (255, 0); */
+			*at_layer(random_layer, i, j) = randomgen(255);
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+An octave of step 2 or more only reads the random layer at its lattice points,
+which a lattice stores compactly. Along each axis, node k is at k * step, and
+the last node is on the border of the layer. Only the nodes a window of the
+layer depends on are stored: about (width / step) * (height / step) nodes for
+the whole layer instead of width * height.
+*/
+typedef struct {
+	tsize_t width;
+	tsize_t height;
+	tsize_t step;
+	/* Index of the last node of the layer, along rows and columns. */
+	tsize_t row_bound;
+	tsize_t col_bound;
+	/* Stored nodes, the last ones included. */
+	tsize_t row_first;
+	tsize_t row_last;
+	tsize_t col_first;
+	tsize_t col_last;
+	Uint8 *v;
+} lattice;
+
+/* Coordinate of a node along an axis of 'size' pixels. */
+tsize_t lattice_coord(tsize_t size, tsize_t step, tsize_t node) {
+	tarea_t x = (tarea_t)node * step;
+	return x >= size - 1 ? size - 1 : x;
+}
+
+/* Index of the last node along an axis of 'size' pixels. */
+tsize_t lattice_bound(tsize_t size, tsize_t step) {
+	return (size - 1 + step - 1) / step;
+}
+
+/* Bytes of the stored nodes. */
+tarea_t lattice_area(const lattice *l) {
+	return (tarea_t)(l->row_last - l->row_first + 1) *
+		(l->col_last - l->col_first + 1);
+}
+
+/*
+Nodes the pixels from 'begin' to 'end' excluded depend on, along an axis whose
+last node is 'bound'.
+*/
+void lattice_range(tsize_t step, tsize_t bound, tsize_t begin, tsize_t end,
+	tsize_t *first, tsize_t *last) {
+	*first = begin / step;
+	*last = (end - 1) / step + 1;
+	if (*last > bound) {
+		*last = bound;
+	}
+}
+
+/*
+Lattice for the window of rows from 'row_begin' to 'row_end' and columns from
+'col_begin' to 'col_end', ends excluded.
+*/
+int lattice_init(lattice *l, tsize_t width, tsize_t height, tsize_t step,
+	tsize_t row_begin, tsize_t row_end, tsize_t col_begin, tsize_t col_end) {
+	l->width = width;
+	l->height = height;
+	l->step = step;
+	l->row_bound = lattice_bound(width, step);
+	l->col_bound = lattice_bound(height, step);
+	lattice_range(step, l->row_bound, row_begin, row_end, &l->row_first,
+		&l->row_last);
+	lattice_range(step, l->col_bound, col_begin, col_end, &l->col_first,
+		&l->col_last);
+	l->v = malloc(lattice_area(l));
+	if (!l->v) {
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Last random row the stored nodes depend on. */
+tsize_t lattice_last_row(const lattice *l) {
+	return lattice_coord(l->width, l->step, l->row_last);
+}
+
+/* Node of the random row i, if it is one. */
+int lattice_node(const lattice *l, tsize_t i, tsize_t *node) {
+	if (i == l->width - 1) {
+		*node = l->row_bound;
+		return 1;
+	}
+	if (i % l->step == 0) {
+		*node = i / l->step;
+		return 1;
+	}
+	return 0;
+}
+
+void lattice_store(lattice *l, tsize_t i, const Uint8 *row) {
+	tsize_t node, k;
+	if (!lattice_node(l, i, &node) || node < l->row_first ||
+		node > l->row_last) {
+		return;
+	}
+
+	tsize_t cols = l->col_last - l->col_first + 1;
+	Uint8 *dest = l->v + (tarea_t)(node - l->row_first) * cols;
+	for (k = l->col_first; k <= l->col_last; k++) {
+		dest[k - l->col_first] = row[lattice_coord(l->height, l->step, k)];
+	}
+}
+
+const Uint8 *lattice_source_row(void *data, tsize_t i, tsize_t begin,
+	tsize_t end, Uint8 *buf) {
+	lattice *l = data;
+	tsize_t node, k;
+	(void)begin;
+	(void)end;
+
+	/* Octaves only read the rows of the stored nodes. Other rows are left
+	 * as they are in 'buf'. */
+	if (!lattice_node(l, i, &node) || node < l->row_first ||
+		node > l->row_last) {
+		return buf;
+	}
+	tsize_t cols = l->col_last - l->col_first + 1;
+	const Uint8 *src = l->v + (tarea_t)(node - l->row_first) * cols;
+	for (k = l->col_first; k <= l->col_last; k++) {
+		buf[lattice_coord(l->height, l->step, k)] = src[k - l->col_first];
+	}
+	return buf;
+}
+
+/* Next random row of the rand() sequence, or row i of the hash generator. */
+void random_row(Uint8 *dest, tsize_t i, tsize_t height, Uint32 seed,
+	const render_options *opt) {
+	tsize_t j;
+
+	if (opt->rng == RNG_HASH) {
+		hash_row(dest, seed, i, 0, height);
+		return;
+	}
+
+	for (j = 0; j < height; j++) {
+		dest[j] = randomgen(255);
+	}
+}
+
+/*
+Frequency and persistence of every octave. The frequency is multiplied by the
+base frequency at every octave, and so is the persistence.
+
+The default accumulation is done on the 8-bit base layer itself, with one
+truncation per octave. It may wrap around if the sum of the persistences is
+greater than 1. With the wide accumulator, the persistences are normalized
+beforehand into Q16 fixed-point weights and summed on 32 bits, and the base
+layer is written once at the end with rounding. The sum cannot overflow since
+the weights add up to 1.
+
+In fixed-point mode, the default accumulation keeps its 8-bit semantics but
+the persistences and the normalization factor are Q16 integers. Only the low
+8 bits of the result matter, so the weights are kept modulo 2^24: the products
+then fit in 32 bits and still wrap around like the floating-point path.
+
+Error bound against the floating-point path, as long as nothing wraps around:
+each pass of the interpolation is off by at most 1 level, so an octave is off
+by at most 2. The result is then off by at most 2 with the wide accumulator,
+and by at most 3 + octaves / sum_persistences otherwise.
+
+Octaves which cannot change the 8-bit result are pruned from the plan: those
+whose contribution is truncated to 0 whatever their value, i.e. 255 times their
+persistence is below 1 (below 1 in Q16 in fixed-point mode), or whose weight is
+0 with the wide accumulator. They still count in the normalization, so that the
+result is exactly the same. With value noise, consecutive octaves of the same
+step read the same points of the random layer and produce the same rows, which
+happens once the step drops to 0 and every octave copies the random layer. They
+are collapsed into one octave, and its row is summed once per octave it stands
+for. Gradient noises have a seed per octave and are never collapsed.
+
+'octaves' is then the number of octaves to compute, and the persistences and
+weights are those of the 'terms' octaves summed, in order.
+*/
+typedef struct {
+	Uint16 octaves;
+	Uint16 *frequencies;
+	/* Octave of the descriptor, for the seeds of the gradient noises. */
+	Uint16 *index;
+	/* Number of terms every octave is summed for. */
+	Uint16 *repeats;
+	Uint16 terms;
+	double *work_persistence;
+	double sum_persistences;
+	/* Q16 weights, only for the wide accumulator. */
+	Uint32 *weight;
+	/* Q16 persistences and normalization, only in fixed-point mode. */
+	Uint32 *fixed_persistence;
+	Uint32 fixed_normalization;
+	int fixed_point;
+} octave_plan;
+
+void octave_plan_free(octave_plan *plan) {
+	free(plan->frequencies);
+	free(plan->index);
+	free(plan->repeats);
+	free(plan->work_persistence);
+	free(plan->weight);
+	free(plan->fixed_persistence);
+}
+
+/* Q16 value of x, modulo 2^24. */
+Uint32 fixed_weight(double x) {
+	return fmod(x * 65536 + 0.5, 16777216.0);
+}
+
+/* Whether the term n of the plan is truncated to 0 whatever the octave. */
+int octave_pruned(const octave_plan *plan, Uint16 n) {
+	if (plan->weight) {
+		return plan->weight[n] == 0;
+	}
+	if (plan->fixed_persistence) {
+		return 255 * plan->fixed_persistence[n] < 65536;
+	}
+	/* Also checks that the sum is not rounded up to the next integer. */
+	return 255 + 255 * plan->work_persistence[n] < 256;
+}
+
+/* Drop the pruned terms and collapse the octaves, see octave_plan. */
+void octave_plan_prune(octave_plan *plan, tsize_t width, tsize_t height,
+	const render_options *opt) {
+	Uint16 n, kept = 0;
+	tsize_t last_step = 0;
+
+	plan->octaves = 0;
+	for (n = 0; n < plan->terms; n++) {
+		if (octave_pruned(plan, n)) {
+			continue;
+		}
+
+		tsize_t step = octave_step(width, height, plan->frequencies[n]);
+		if (opt->noise == NOISE_VALUE && plan->octaves != 0 &&
+			step == last_step) {
+			plan->repeats[plan->octaves - 1]++;
+		} else {
+			plan->frequencies[plan->octaves] = plan->frequencies[n];
+			plan->index[plan->octaves] = n;
+			plan->repeats[plan->octaves] = 1;
+			plan->octaves++;
+		}
+		last_step = step;
+
+		plan->work_persistence[kept] = plan->work_persistence[n];
+		if (plan->weight) {
+			plan->weight[kept] = plan->weight[n];
+		}
+		if (plan->fixed_persistence) {
+			plan->fixed_persistence[kept] = plan->fixed_persistence[n];
+		}
+		kept++;
+	}
+
+	if (kept != plan->terms || plan->octaves != kept) {
+		char buf[128];
+		snprintf(buf, sizeof buf, "Octaves: %u, pruned %u, collapsed %u.",
+			plan->terms, plan->terms - kept, kept - plan->octaves);
+		trace(buf);
+	}
+	plan->terms = kept;
+}
+
+int octave_plan_init(octave_plan *plan, Uint16 frequency, Uint16 octaves,
+	double persistence, tsize_t width, tsize_t height,
+	const render_options *opt) {
+	Uint16 n;               /* Current octave. */
+	Uint16 f = frequency;   /* Current frequency. Changes with octaves. */
+	int fixed = opt->fixed_point && !opt->wide_accumulator;
+
+	plan->octaves = octaves;
+	plan->terms = octaves;
+	plan->frequencies = malloc(octaves * sizeof (Uint16));
+	plan->index = malloc(octaves * sizeof (Uint16));
+	plan->repeats = malloc(octaves * sizeof (Uint16));
+	plan->work_persistence = malloc(octaves * sizeof (double));
+	plan->sum_persistences = 0;
+	plan->weight = NULL;
+	plan->fixed_persistence = NULL;
+	plan->fixed_normalization = 0;
+	plan->fixed_point = opt->fixed_point;
+	if (opt->wide_accumulator) {
+		plan->weight = malloc(octaves * sizeof (Uint32));
+	}
+	if (fixed) {
+		plan->fixed_persistence = malloc(octaves * sizeof (Uint32));
+	}
+	if (!plan->frequencies || !plan->index || !plan->repeats ||
+		!plan->work_persistence || (opt->wide_accumulator && !plan->weight) ||
+		(fixed && !plan->fixed_persistence)) {
+		octave_plan_free(plan);
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+
+	for (n = 0; n < octaves; n++) {
+		plan->frequencies[n] = f;
+		f *= frequency;
+		if (n == 0) {
+			plan->work_persistence[n] = persistence;
+		} else {
+			plan->work_persistence[n] =
+				plan->work_persistence[n - 1] * persistence;
+		}
+		plan->sum_persistences += plan->work_persistence[n];
+	}
+	if (plan->weight) {
+		for (n = 0; n < octaves; n++) {
+			plan->weight[n] =
+				plan->work_persistence[n] / plan->sum_persistences * 65536 + 0.5;
+		}
+	}
+	if (plan->fixed_persistence) {
+		for (n = 0; n < octaves; n++) {
+			plan->fixed_persistence[n] =
+				fixed_weight(plan->work_persistence[n]);
+		}
+		if (plan->sum_persistences > 0) {
+			plan->fixed_normalization =
+				fixed_weight(1 / plan->sum_persistences);
+		}
+	}
+
+	octave_plan_prune(plan, width, height, opt);
+	return EXIT_SUCCESS;
+}
+
+/*
+Random source of every octave. The hash generator evaluates the lattice points
+on demand and stores nothing. With rand(), the whole sequence must be run, but
+only the lattice points are kept. The full random layer is only generated when
+an octave reads every point, i.e. when its step is below 2; all the octaves
+then read it.
+*/
+typedef struct {
+	Uint16 octaves;
+	random_source *sources;
+	hash_rng *hashes;
+	lattice *lattices;
+	layer full;
+} random_store;
+
+void random_store_free(random_store *r, const render_options *opt) {
+	Uint16 n;
+	if (r->lattices) {
+		for (n = 0; n < r->octaves; n++) {
+			free(r->lattices[n].v);
+		}
+	}
+	free(r->lattices);
+	free(r->hashes);
+	free(r->sources);
+	layer_release(&r->full, opt);
+}
+
+int random_store_init(random_store *r, const octave_plan *plan, tsize_t width,
+	tsize_t height, Uint32 seed, const render_options *opt) {
+	Uint16 n;
+	tsize_t i;
+	int full = 0;
+
+	r->octaves = plan->octaves;
+	r->sources = malloc(plan->octaves * sizeof (random_source));
+	r->hashes = malloc(plan->octaves * sizeof (hash_rng));
+	r->lattices = calloc(plan->octaves, sizeof (lattice));
+	r->full.v = NULL;
+	if (!r->sources || !r->hashes || !r->lattices) {
+		random_store_free(r, opt);
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+
+	for (n = 0; n < plan->octaves; n++) {
+		tsize_t step = octave_step(width, height, plan->frequencies[n]);
+		if (opt->noise != NOISE_VALUE) {
+			r->sources[n] = gradient_source(width, height, plan->index[n],
+				seed, opt);
+		} else if (opt->rng == RNG_HASH) {
+			hash_rng rng = { seed, height, step };
+			r->hashes[n] = rng;
+			random_source src = {
+				hash_source_row, &r->hashes[n], width, height, 0, 0
+			};
+			r->sources[n] = src;
+		} else if (step < 2) {
+			full = 1;
+		}
+	}
+	if (opt->noise != NOISE_VALUE || opt->rng == RNG_HASH) {
+		return EXIT_SUCCESS;
+	}
+
+	if (full) {
+		if (generate_random_layer(&r->full, width, height, seed, opt) ==
+			EXIT_FAILURE) {
+			random_store_free(r, opt);
+			return EXIT_FAILURE;
+		}
+		for (n = 0; n < plan->octaves; n++) {
+			r->sources[n] = layer_source(&r->full);
+		}
+		return EXIT_SUCCESS;
+	}
+
+	Uint8 *row = malloc(height);
+	if (!row) {
+		random_store_free(r, opt);
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+	for (n = 0; n < plan->octaves; n++) {
+		if (lattice_init(&r->lattices[n], width, height,
+				octave_step(width, height, plan->frequencies[n]), 0, width, 0,
+				height) == EXIT_FAILURE) {
+			free(row);
+			random_store_free(r, opt);
+			return EXIT_FAILURE;
+		}
+		random_source src = {
+			lattice_source_row, &r->lattices[n], width, height, 0, 0
+		};
+		r->sources[n] = src;
+	}
+
+	/* The rand() sequence defines the texture, so it is run in full even
+	 * though most of it is discarded. */
+	srand(seed);
+	for (i = 0; i < width; i++) {
+		random_row(row, i, height, seed, opt);
+		for (n = 0; n < plan->octaves; n++) {
+			lattice_store(&r->lattices[n], i, row);
+		}
+	}
+
+	free(row);
+	return EXIT_SUCCESS;
+}
+
+/*
+Sum of the octaves at row i, normalized, in 'dest'. 'length' is the number of
+columns the octaves produce. 'row' is a scratch row, and 'wide' the 32-bit
+accumulator row when the plan has weights.
+*/
+void work_row(const octave_plan *plan, octave *o, tsize_t i, tsize_t length,
+	Uint8 *row, Uint32 *wide, Uint8 *dest) {
+	tsize_t j;
+	Uint16 n, r, t = 0;
+
+	if (plan->weight) {
+		memset(wide, 0, length * sizeof (Uint32));
+		for (n = 0; n < plan->octaves; n++) {
+			octave_row(&o[n], i, row);
+			for (r = 0; r < plan->repeats[n]; r++, t++) {
+				for (j = 0; j < length; j++) {
+					wide[j] += row[j] * plan->weight[t];
+				}
+			}
+		}
+
+		/* Normalizing. */
+		for (j = 0; j < length; j++) {
+			Uint32 v = (wide[j] + 32768) >> 16;
+			dest[j] = v > 255 ? 255 : v;
+		}
+		return;
+	}
+
+	if (plan->fixed_persistence) {
+		memset(dest, 0, length);
+		for (n = 0; n < plan->octaves; n++) {
+			octave_row(&o[n], i, row);
+			for (r = 0; r < plan->repeats[n]; r++, t++) {
+				Uint32 w = plan->fixed_persistence[t];
+				for (j = 0; j < length; j++) {
+					dest[j] += (row[j] * w) >> 16;
+				}
+			}
+		}
+
+		/* Normalizing. */
+		for (j = 0; j < length; j++) {
+			dest[j] = (dest[j] * plan->fixed_normalization) >> 16;
+		}
+		return;
+	}
+
+	memset(dest, 0, length);
+	for (n = 0; n < plan->octaves; n++) {
+		octave_row(&o[n], i, row);
+		for (r = 0; r < plan->repeats[n]; r++, t++) {
+			for (j = 0; j < length; j++) {
+				dest[j] += row[j] * plan->work_persistence[t];
+			}
+		}
+	}
+
+	/* Normalizing. */
+	for (j = 0; j < length; j++) {
+		dest[j] = dest[j] / plan->sum_persistences;
+	}
+}
+
+void octaves_free(octave *o, Uint16 count) {
+	Uint16 n;
+	for (n = 0; n < count; n++) {
+		octave_free(&o[n]);
+	}
+	free(o);
+}
+
+/*
+Octaves are computed one row at a time and summed straight into the base layer,
+so that no full-size layer is needed per octave. Each band of rows goes through
+all the octaves, so that the bands are independent.
+*/
+typedef struct {
+	layer *current_layer;
+	const random_source *sources;
+	tsize_t band;
+	const octave_plan *plan;
+} work_job;
+
+int work_band(void *data, unsigned long index) {
+	work_job *job = data;
+	const octave_plan *plan = job->plan;
+	tsize_t width = job->current_layer->width;
+	tsize_t height = job->current_layer->height;
+	tsize_t i;
+	tsize_t begin = index * job->band;
+	tsize_t end = width - begin < job->band ? width : begin + job->band;
+	Uint16 n;
+
+	octave *o = malloc(plan->octaves * sizeof (octave));
+	Uint8 *row = malloc(height * sizeof (Uint8));
+	Uint32 *wide = malloc(height * sizeof (Uint32));
+	if (!o || !row || !wide) {
+		free(o);
+		free(row);
+		free(wide);
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+
+	for (n = 0; n < plan->octaves; n++) {
+		if (octave_init(&o[n], job->sources[n], plan->frequencies[n], 0,
+				height, plan->fixed_point) == EXIT_FAILURE) {
+			octaves_free(o, n);
+			free(row);
+			free(wide);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = begin; i < end; i++) {
+		work_row(plan, o, i, height, row, wide,
+			at_layer(job->current_layer, i, 0));
+	}
+
+	octaves_free(o, plan->octaves);
+	free(row);
+	free(wide);
+
+	return EXIT_SUCCESS;
+}
+
+int generate_work_layer(Uint16 frequency,
+	Uint16 octaves,
+	double persistence,
+	Uint32 seed,
+	layer *current_layer,
+	const render_options *opt) {
+	octave_plan plan;
+	if (octave_plan_init(&plan, frequency, octaves, persistence,
+			current_layer->width, current_layer->height, opt) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+
+	random_store random;
+	if (random_store_init(&random, &plan, current_layer->width,
+			current_layer->height, seed, opt) == EXIT_FAILURE) {
+		octave_plan_free(&plan);
+		trace("Random layer failed.");
+		return EXIT_FAILURE;
+	}
+
+	work_job job = {
+		current_layer, random.sources, band_rows(current_layer->width, opt),
+		&plan
+	};
+	int status = pool_run(opt->workers,
+			band_count(current_layer->width, job.band), work_band, &job);
+
+	random_store_free(&random, opt);
+	octave_plan_free(&plan);
+	return status;
+}
+
+/*
+We set the x,y pixel to be the mean of all pixels in the k,l square around
+it. The new pixel value type needs to be higher than traditionnal pixel
+because we sum pixels and thus it may overflow. The damping factor is the
+number of pixels in the square. We need to compute it every time when we are
+close to a border and k,l is no longer a square.
+
+The square is never summed as a whole. The filter is separable, so we keep for
+every column the sum of the k range (running sums along x), and every pixel is
+the sum of the l range of these column sums (running sum along y). Moving the
+square by one pixel is an addition and a subtraction, so the cost does not
+depend on the factor. Sums are exact integers, so the result is the same as a
+direct summation.
+*/
+void column_add(Uint32 *column, const Uint8 *row, tsize_t size) {
+	tsize_t l;
+	for (l = 0; l < size; l++) {
+		column[l] += row[l];
+	}
+}
+
+void column_sub(Uint32 *column, const Uint8 *row, tsize_t size) {
+	tsize_t l;
+	for (l = 0; l < size; l++) {
+		column[l] -= row[l];
+	}
+}
+
+/*
+Horizontal pass: 'column' holds the sum of the k range for every column, and
+'rows' is the length of the k range.
+*/
+void smooth_row(Uint8 *dest, const Uint32 *column, tsize_t size,
+	tsize_t factor, tsize_t rows) {
+	tsize_t y, l;
+	tsize_t lbegin, lend; /* Ranges. */
+
+	tarea_t pixel_val = 0;
+	lbegin = 0;
+	lend = factor >= size ? size - 1 : factor;
+	for (l = lbegin; l <= lend; l++) {
+		pixel_val += column[l];
+	}
+
+	for (y = 0; y < size; y++) {
+		tsize_t next_lbegin = factor > y ? 0 : y - factor;
+		tsize_t next_lend = factor >= size - y ? size - 1 : y + factor;
+		for (; lbegin < next_lbegin; lbegin++) {
+			pixel_val -= column[lbegin];
+		}
+		for (; lend < next_lend; lend++) {
+			pixel_val += column[lend + 1];
+		}
+
+		tarea_t damping = (tarea_t)rows * (tarea_t)(lend - lbegin + 1);
+		dest[y] = (double)pixel_val / damping;
+	}
+}
+
+typedef struct {
+	layer *dest;
+	layer *src;
+	tsize_t factor;
+	tsize_t band;
+} smooth_job;
+
+int smooth_band(void *data, unsigned long index) {
+	smooth_job *job = data;
+	layer *src = job->src;
+	tsize_t width = src->width, height = src->height;
+	tsize_t factor = job->factor;
+	tsize_t x;              /* Point coordinates */
+	tsize_t k;              /* Coordinates of the points in the square around (x,y). */
+	tsize_t begin = index * job->band;
+	tsize_t end = width - begin < job->band ? width : begin + job->band;
+
+	/* Sum of the k range for every column. */
+	Uint32 *column = calloc(height, sizeof (Uint32));
+	if (!column) {
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+
+	tsize_t kbegin, kend; /* Ranges. */
+	kbegin = factor > begin ? 0 : begin - factor;
+	kend = factor >= width - begin ? width - 1 : begin + factor;
+	for (k = kbegin; k <= kend; k++) {
+		column_add(column, at_layer(src, k, 0), height);
+	}
+
+	for (x = begin; x < end; x++) {
+		tsize_t next_kbegin = factor > x ? 0 : x - factor;
+		tsize_t next_kend = factor >= width - x ? width - 1 : x + factor;
+		for (; kbegin < next_kbegin; kbegin++) {
+			column_sub(column, at_layer(src, kbegin, 0), height);
+		}
+		for (; kend < next_kend; kend++) {
+			column_add(column, at_layer(src, kend + 1, 0), height);
+		}
+
+		smooth_row(at_layer(job->dest, x, 0), column, height, factor,
+			kend - kbegin + 1);
+	}
+
+	free(column);
+	return EXIT_SUCCESS;
+}
+
+int box_filter(layer *dest, layer *src, tsize_t factor,
+	const render_options *opt) {
+	smooth_job job = { dest, src, factor, band_rows(src->width, opt) };
+	return pool_run(opt->workers, band_count(src->width, job.band), smooth_band,
+			&job);
+}
+
+/*
+The Gaussian smoothing is approximated by three consecutive box filters. The
+radius of the boxes is chosen so that the variance of the result is the variance
+of a single box of radius 'factor', i.e.
+
+        3 * ((2r + 1)^2 - 1) = (2 * factor + 1)^2 - 1
+
+so that both modes blur about as much.
+*/
+tsize_t gaussian_radius(tsize_t factor) {
+	double width = 2 * (double)factor + 1;
+	double r = (sqrt((width * width - 1) / 3 + 1) - 1) / 2;
+	tsize_t radius = r + 0.5;
+	return radius == 0 && factor != 0 ? 1 : radius;
+}
+
+/* Smooth into 'smoothed_layer', already acquired. */
+int smooth_layer_into(layer *smoothed_layer, tsize_t factor,
+	layer *current_layer, const render_options *opt) {
+	tsize_t width = current_layer->width, height = current_layer->height;
+
+	if (!opt->gaussian_smoothing) {
+		return box_filter(smoothed_layer, current_layer, factor, opt);
+	}
+
+	layer tmp;
+	if (layer_acquire(&tmp, width, height, opt) == EXIT_FAILURE) {
+		trace("Could not init smoothed layer.");
+		return EXIT_FAILURE;
+	}
+
+	tsize_t radius = gaussian_radius(factor);
+	int status = EXIT_SUCCESS;
+	if (box_filter(smoothed_layer, current_layer, radius, opt) == EXIT_FAILURE ||
+		box_filter(&tmp, smoothed_layer, radius, opt) == EXIT_FAILURE ||
+		box_filter(smoothed_layer, &tmp, radius, opt) == EXIT_FAILURE) {
+		status = EXIT_FAILURE;
+	}
+
+	layer_release(&tmp, opt);
+	return status;
+}
+
+int smooth_layer(layer *smoothed_layer, tsize_t factor, layer *current_layer,
+	const render_options *opt) {
+	if (layer_acquire(smoothed_layer, current_layer->width,
+			current_layer->height, opt) == EXIT_FAILURE) {
+		trace("Could not init smoothed layer.");
+		return EXIT_FAILURE;
+	}
+
+	if (smooth_layer_into(smoothed_layer, factor, current_layer, opt) ==
+		EXIT_FAILURE) {
+		layer_release(smoothed_layer, opt);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+/******************************************************************************/
+/* Streaming. */
+
+/*
+Output files are written by strips of layer rows, see output_band() for the
+orientation. Layer rows are columns of the picture, so a strip is one segment
+in every line of the file. Files are not mapped here: the strip keeps the
+memory used within the budget.
+*/
+typedef struct {
+	int fd;
+	output_layout layout;
+	tsize_t band;
+	/* First layer row of the strip, and number of rows in the strip. */
+	tsize_t first;
+	tsize_t rows;
+	/* One segment of 'band' pixels per line of the file. */
+	Uint8 *strip;
+	Uint8 palette[PALETTE_SIZE][3];
+} output_stream;
+
+int output_stream_open(output_stream *b, unsigned int result, tsize_t width,
+	tsize_t height, tsize_t band, colorizer colorize, const void *param,
+	const render_options *opt) {
+	const output_driver *d = &output_drivers[opt->format];
+	unsigned int depth = result_depth(result, opt);
+	char filename[FILENAME_MAX];
+	output_layout_init(&b->layout, d, width, height, depth);
+	b->band = band;
+	b->first = 0;
+	b->rows = 0;
+	b->strip = malloc((tarea_t)height * band * depth);
+	if (!b->strip) {
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+
+	palette_init(b->palette, colorize, param, d->bgr);
+
+	b->fd = output_open(filename, result, O_WRONLY, opt);
+	if (b->fd == -1) {
+		free(b->strip);
+		return EXIT_FAILURE;
+	}
+
+	/* The padding is zeroed by the truncation. */
+	Uint8 header[OUTPUT_HEADER_MAX];
+	d->header(header, width, height, depth);
+	if (pwrite(b->fd, header, b->layout.offset, 0) !=
+		(ssize_t)b->layout.offset ||
+		ftruncate(b->fd, b->layout.size) == -1) {
+		perror(filename);
+		close(b->fd);
+		free(b->strip);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+int output_stream_flush(output_stream *b) {
+	tsize_t j;
+	unsigned int depth = b->layout.depth;
+	size_t length = (size_t)b->rows * depth;
+
+	for (j = 0; j < b->layout.height; j++) {
+		off_t offset = output_line_offset(&b->layout, j) +
+			(tarea_t)b->first * depth;
+		const Uint8 *segment = b->strip + (tarea_t)j * b->band * depth;
+		if (pwrite(b->fd, segment, length, offset) != (ssize_t)length) {
+			perror("pwrite");
+			return EXIT_FAILURE;
+		}
+	}
+
+	b->first += b->rows;
+	b->rows = 0;
+	return EXIT_SUCCESS;
+}
+
+int output_stream_push(output_stream *b, const Uint8 *row) {
+	tsize_t j;
+	unsigned int depth = b->layout.depth;
+	Uint8 *pixel = b->strip + (tarea_t)b->rows * depth;
+
+	for (j = 0; j < b->layout.height; j++) {
+		memcpy(pixel, b->palette[row[j]], depth);
+		pixel += (tarea_t)b->band * depth;
+	}
+
+	b->rows++;
+	if (b->rows == b->band) {
+		return output_stream_flush(b);
+	}
+	return EXIT_SUCCESS;
+}
+
+int output_stream_close(output_stream *b) {
+	int status = EXIT_SUCCESS;
+	if (b->rows != 0) {
+		status = output_stream_flush(b);
+	}
+
+	if (close(b->fd) == -1) {
+		perror("close");
+		status = EXIT_FAILURE;
+	}
+	free(b->strip);
+	return status;
+}
+
+/* Open outputs of the streaming mode, and the window of the picture they hold. */
+typedef struct {
+	output_stream files[RESULT_COUNT];
+	/* RESULT_BIT() flags of the open files. */
+	unsigned int opened;
+	region window;
+} stream_outputs;
+
+/*
+Push layer row x to the open outputs from 'first' to 'last', if it is in the
+window. 'row' starts at column y, and is cropped to the window.
+*/
+int stream_outputs_push(stream_outputs *s, unsigned int first,
+	unsigned int last, tsize_t x, tsize_t y, const Uint8 *row) {
+	unsigned int r;
+
+	if (x < s->window.x || x - s->window.x >= s->window.width) {
+		return EXIT_SUCCESS;
+	}
+	for (r = first; r <= last; r++) {
+		if ((s->opened & RESULT_BIT(r)) &&
+			output_stream_push(&s->files[r], row + (s->window.y - y)) ==
+			EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+Box filter on a stream of rows. A row is pushed with box_stream_push(), and the
+smoothed rows are popped as soon as the rows below them within the factor are
+known. The ring keeps the rows of the current square plus the one to remove
+next.
+*/
+typedef struct {
+	/* Number of rows, and their length. */
+	tsize_t rows;
+	tsize_t length;
+	tsize_t factor;
+	tsize_t capacity;
+	Uint8 *ring;
+	Uint32 *column;
+	/* Rows received and rows produced. */
+	tsize_t in;
+	tsize_t out;
+	/* Range of rows summed in 'column', end excluded. */
+	tsize_t kbegin;
+	tsize_t kend;
+} box_stream;
+
+int box_stream_init(box_stream *b, tsize_t rows, tsize_t length,
+	tsize_t factor) {
+	b->rows = rows;
+	b->length = length;
+	b->factor = factor;
+	b->capacity = factor >= rows / 2 ? rows : 2 * factor + 2;
+	b->ring = malloc((tarea_t)b->capacity * length);
+	b->column = calloc(length, sizeof (Uint32));
+	if (!b->ring || !b->column) {
+		free(b->ring);
+		free(b->column);
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+	b->in = b->out = 0;
+	b->kbegin = b->kend = 0;
+	return EXIT_SUCCESS;
+}
+
+void box_stream_free(box_stream *b) {
+	free(b->ring);
+	free(b->column);
+}
+
+Uint8 *box_stream_ring(box_stream *b, tsize_t k) {
+	return b->ring + (tarea_t)(k % b->capacity) * b->length;
+}
+
+void box_stream_push(box_stream *b, const Uint8 *row) {
+	memcpy(box_stream_ring(b, b->in), row, b->length);
+	b->in++;
+}
+
+/* Return 1 and write the next smoothed row to 'dest' if it is ready. */
+int box_stream_pop(box_stream *b, Uint8 *dest) {
+	tsize_t x = b->out;
+	tsize_t rows = b->rows;
+	tsize_t factor = b->factor;
+
+	if (x >= rows || (b->in < rows && b->in <= x + factor)) {
+		return 0;
+	}
+
+	tsize_t next_kbegin = factor > x ? 0 : x - factor;
+	tsize_t next_kend = factor >= rows - x ? rows : x + factor + 1;
+	for (; b->kbegin < next_kbegin; b->kbegin++) {
+		column_sub(b->column, box_stream_ring(b, b->kbegin), b->length);
+	}
+	for (; b->kend < next_kend; b->kend++) {
+		column_add(b->column, box_stream_ring(b, b->kend), b->length);
+	}
+
+	smooth_row(dest, b->column, b->length, factor, b->kend - b->kbegin);
+	b->out++;
+	return 1;
+}
+
+/*
+Push a row through the chain of smoothing passes. Rows are popped from a pass as
+soon as they are ready, which bounds what the rings must hold. The last pass
+writes to the three smoothed outputs. The rows of the passes start at layer row
+x and column y.
+*/
+int smooth_stream_push(box_stream *b, Uint8 **rows, unsigned int passes,
+	const Uint8 *row, tsize_t x, tsize_t y, stream_outputs *outputs) {
+	box_stream_push(b, row);
+	while (box_stream_pop(b, rows[0])) {
+		if (passes > 1) {
+			if (smooth_stream_push(b + 1, rows + 1, passes - 1, rows[0], x, y,
+					outputs) == EXIT_FAILURE) {
+				return EXIT_FAILURE;
+			}
+			continue;
+		}
+		if (stream_outputs_push(outputs, RESULT_GS_SMOOTH, RESULT_ALT_SMOOTH,
+				x + b->out - 1, y, rows[0]) == EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+In streaming mode the texture is rendered one row at a time, and the outputs
+are written by bands of rows. No full layer is ever in memory.
+
+The random layer is defined by the sequence of rand() calls, so it can only be
+generated in order. An octave of step s needs the random rows up to s rows
+ahead of the current row. For the coarse octaves, this would be a large part of
+the layer, but they only read a few lattice points: a first run of the sequence
+stores these points in compact lattices. Fine octaves read the random rows from
+a ring buffer, which a second run of the sequence fills as the rendering goes.
+Octaves with a step above the cube root of the longer side are coarse, which
+balances the memory of both.
+
+A window of the picture can be rendered alone, see stream_render(). Only the
+lattice points it depends on are stored, or computed with the hash generator.
+The rand() sequence still has to be run from the start, but only up to the last
+row the window depends on.
+*/
+typedef struct {
+	/* Length of the rows. */
+	tsize_t height;
+	/* Next row to generate, and how far ahead of the current row. */
+	tsize_t next;
+	tsize_t ahead;
+	tsize_t capacity;
+	Uint8 *ring;
+} random_stream;
+
+const Uint8 *random_stream_row(void *data, tsize_t i, tsize_t begin,
+	tsize_t end, Uint8 *buf) {
+	random_stream *r = data;
+	(void)begin;
+	(void)end;
+	(void)buf;
+	return r->ring + (tarea_t)(i % r->capacity) * r->height;
+}
+
+tsize_t stream_threshold(tsize_t size) {
+	tsize_t threshold = cbrt(size);
+	return threshold < 1 ? 1 : threshold;
+}
+
+/*
+The band is the number of rows buffered by every output before being written.
+It takes whatever the budget leaves once the fixed buffers are accounted for.
+*/
+tsize_t stream_band(tsize_t width, tsize_t height, tarea_t fixed,
+	unsigned int outputs, tarea_t max_memory) {
+	tarea_t per_row = (tarea_t)height * 3 * outputs;
+	tarea_t band = 1;
+
+	if (max_memory > fixed) {
+		band = (max_memory - fixed) / per_row;
+	}
+	if (band == 0 || max_memory <= fixed) {
+		trace("Memory budget too small, writing one row at a time.");
+		band = 1;
+	}
+	return band > width ? width : band;
+}
+
+/* Clamp the range from 'begin' to 'end' extended by 'margin' to the layer. */
+void stream_margin(tsize_t begin, tsize_t end, tsize_t margin, tsize_t size,
+	tsize_t *first, tsize_t *last) {
+	*first = begin > margin ? begin - margin : 0;
+	*last = size - end > margin ? end + margin : size;
+}
+
+/*
+Render the window of the picture set in the options, or the whole picture. The
+rendered rows and columns also include the margin the smoothing depends on.
+*/
+int stream_render(texture_parameter *tparam, const render_options *opt) {
+	tsize_t width = tparam->width, height = tparam->height;
+	tsize_t i;
+	Uint16 n;
+	int status = EXIT_SUCCESS;
+
+	if (width == 0 || height == 0) {
+		trace("Texture size cannot be zero.");
+		return EXIT_FAILURE;
+	}
+	if (tparam->persistence_den == 0) {
+		trace("Persistence denominator cannot be zero.");
+		return EXIT_FAILURE;
+	}
+
+	region window = opt->window;
+	if (window.width == 0) {
+		region whole = { 0, 0, width, height };
+		window = whole;
+	}
+	if (window.x > width || window.width > width - window.x ||
+		window.y > height || window.height > height - window.y) {
+		trace("Window is out of the texture.");
+		return EXIT_FAILURE;
+	}
+	if (window.width == 0 || window.height == 0) {
+		return EXIT_SUCCESS;
+	}
+
+	octave_plan plan;
+	if (octave_plan_init(&plan, tparam->frequency, tparam->octaves,
+			(double)tparam->persistence_num / tparam->persistence_den,
+			tparam->width, tparam->height, opt) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+
+	tsize_t factor = tparam->smoothing;
+	unsigned int passes = 0, p;
+	if (tparam->smoothing != 0 && (opt->outputs & RESULT_SMOOTH)) {
+		passes = 1;
+		if (opt->gaussian_smoothing) {
+			factor = gaussian_radius(factor);
+			passes = 3;
+		}
+	}
+
+	/* Rendered rows from 'x0' to 'x1' and columns from 'y0' to 'y1'. */
+	tsize_t x0, x1, y0, y1;
+	stream_margin(window.x, window.x + window.width, passes * factor, width,
+		&x0, &x1);
+	stream_margin(window.y, window.y + window.height, passes * factor, height,
+		&y0, &y1);
+	tsize_t length = y1 - y0;
+
+	/* Every buffer is allocated upfront, so that we can account for them
+	 * before choosing the band. */
+	tsize_t threshold = stream_threshold(width > height ? width : height);
+	tarea_t fixed = 0;
+
+	lattice *lattices = calloc(plan.octaves, sizeof (lattice));
+	octave *o = calloc(plan.octaves, sizeof (octave));
+	Uint8 *row = malloc(height);
+	Uint8 *base_row = malloc(length);
+	Uint8 *smooth_rows[3] = { NULL, NULL, NULL };
+	Uint32 *wide = malloc(length * sizeof (Uint32));
+	random_stream rs = { height, 0, 0, 2, NULL };
+	hash_rng *hashes = malloc(plan.octaves * sizeof (hash_rng));
+	box_stream smoothers[3];
+	unsigned int initialized_passes = 0;
+	stream_outputs outputs;
+	unsigned int r;
+	Uint16 initialized = 0;
+	int coarse = 0, fine = (opt->outputs & RESULT_BIT(RESULT_RANDOM)) != 0;
+	int work = (opt->outputs & ~RESULT_BIT(RESULT_RANDOM)) != 0;
+	/* Last random row the lattices depend on. */
+	tsize_t last_row = 0;
+
+	outputs.opened = 0;
+	outputs.window = window;
+
+	if (!lattices || !o || !row || !base_row || !wide || !hashes) {
+		trace("Allocation error.");
+		status = EXIT_FAILURE;
+		goto clean;
+	}
+	fixed += (tarea_t)height + (tarea_t)length * 5;
+
+	/* The hash generator and the gradient noises compute any point directly.
+	 * The ring is then only used for the random output. */
+	for (n = 0; n < plan.octaves && opt->rng != RNG_HASH &&
+		opt->noise == NOISE_VALUE; n++) {
+		tsize_t step = octave_step(width, height, plan.frequencies[n]);
+		if (step > threshold) {
+			lattice *l = &lattices[n];
+			if (lattice_init(l, width, height, step, x0, x1, y0, y1) ==
+				EXIT_FAILURE) {
+				status = EXIT_FAILURE;
+				goto clean;
+			}
+			fixed += lattice_area(l);
+			if (lattice_last_row(l) > last_row) {
+				last_row = lattice_last_row(l);
+			}
+			coarse = 1;
+		} else {
+			fine = 1;
+			if (step > rs.ahead) {
+				rs.ahead = step;
+			}
+		}
+	}
+
+	/* The ring holds the rows from i - 1 to i + ahead, and when the window
+	 * does not start at the first row, the rows of the first cell too. */
+	rs.capacity = rs.ahead + 2 + (x0 != 0 ? rs.ahead : 0);
+	rs.ring = malloc((tarea_t)rs.capacity * height);
+	if (!rs.ring) {
+		trace("Allocation error.");
+		status = EXIT_FAILURE;
+		goto clean;
+	}
+	fixed += (tarea_t)rs.capacity * height;
+	if (opt->rng == RNG_HASH) {
+		rs.next = x0;
+	}
+
+	for (n = 0; n < plan.octaves; n++) {
+		random_source src = { random_stream_row, &rs, width, height, 0, 0 };
+		if (opt->noise != NOISE_VALUE) {
+			src = gradient_source(width, height, plan.index[n],
+				tparam->seed, opt);
+		} else if (opt->rng == RNG_HASH) {
+			hash_rng rng = {
+				tparam->seed, height,
+				octave_step(width, height, plan.frequencies[n])
+			};
+			hashes[n] = rng;
+			src.row = hash_source_row;
+			src.data = &hashes[n];
+		} else if (lattices[n].v) {
+			src.row = lattice_source_row;
+			src.data = &lattices[n];
+		}
+		if (octave_init(&o[n], src, plan.frequencies[n], y0, y1,
+				plan.fixed_point) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+			goto clean;
+		}
+		initialized++;
+		fixed += (tarea_t)height + (tarea_t)length * 2;
+	}
+
+	for (p = 0; p < passes; p++) {
+		smooth_rows[p] = malloc(length);
+		if (!smooth_rows[p] || box_stream_init(&smoothers[p], x1 - x0, length,
+				factor) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+			goto clean;
+		}
+		initialized_passes++;
+		fixed += (tarea_t)smoothers[p].capacity * length + length * 5;
+	}
+
+	/* Smoothed outputs are skipped along with the smoothing. */
+	unsigned int wanted = opt->outputs;
+	unsigned int count = 0;
+	if (passes == 0) {
+		wanted &= ~RESULT_SMOOTH;
+	}
+	for (r = 0; r < RESULT_COUNT; r++) {
+		count += (wanted & RESULT_BIT(r)) != 0;
+	}
+	if (count == 0) {
+		goto clean;
+	}
+	tsize_t band = stream_band(window.width, window.height, fixed, count,
+			opt->max_memory);
+
+	color_param colors;
+	color_param_init(&colors, tparam);
+	for (r = 0; r < RESULT_COUNT; r++) {
+		colorizer colorize;
+		const void *param;
+		if (!(wanted & RESULT_BIT(r))) {
+			continue;
+		}
+		result_colorizer(r, &colors, &colorize, &param);
+		if (output_stream_open(&outputs.files[r], r, window.width,
+				window.height, band, colorize, param, opt) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+			goto clean;
+		}
+		outputs.opened |= RESULT_BIT(r);
+	}
+
+	stage_begin(opt, "lattices", "Random lattices.");
+	if (coarse && work) {
+		srand(tparam->seed);
+		for (i = 0; i <= last_row; i++) {
+			random_row(row, i, height, tparam->seed, opt);
+			for (n = 0; n < plan.octaves; n++) {
+				if (lattices[n].v) {
+					lattice_store(&lattices[n], i, row);
+				}
+			}
+		}
+	}
+
+	stage_end(opt, coarse && work ? (tarea_t)(last_row + 1) * height : 0);
+
+	stage_begin(opt, "stream", "Stream.");
+	srand(tparam->seed);
+	for (i = x0; i < x1 && status == EXIT_SUCCESS; i++) {
+		/* Fill the ring up to the furthest bound of the fine octaves. */
+		tsize_t ahead = width - 1 - i < rs.ahead ? width - 1 : i + rs.ahead;
+		for (; fine && rs.next <= ahead; rs.next++) {
+			Uint8 *dest = rs.ring + (tarea_t)(rs.next % rs.capacity) * height;
+			random_row(dest, rs.next, height, tparam->seed, opt);
+			if (stream_outputs_push(&outputs, RESULT_RANDOM, RESULT_RANDOM,
+					rs.next, 0, dest) == EXIT_FAILURE) {
+				status = EXIT_FAILURE;
+			}
+		}
+		if (!work) {
+			continue;
+		}
+
+		work_row(&plan, o, i, length, row, wide, base_row);
+
+		if (stream_outputs_push(&outputs, RESULT_GS, RESULT_ALT, i, y0,
+				base_row) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+		}
+
+		if (passes != 0 && smooth_stream_push(smoothers, smooth_rows, passes,
+				base_row, x0, y0, &outputs) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+		}
+	}
+	if (status == EXIT_SUCCESS) {
+		stage_end(opt, (tarea_t)window.width * window.height);
+	}
+
+clean:
+	for (r = RESULT_COUNT; r > 0; r--) {
+		if ((outputs.opened & RESULT_BIT(r - 1)) &&
+			output_stream_close(&outputs.files[r - 1]) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+		}
+	}
+	for (p = 0; p < initialized_passes; p++) {
+		box_stream_free(&smoothers[p]);
+	}
+	for (p = 0; p < 3; p++) {
+		free(smooth_rows[p]);
+	}
+	for (n = 0; n < initialized; n++) {
+		octave_free(&o[n]);
+	}
+	if (lattices) {
+		for (n = 0; n < plan.octaves; n++) {
+			free(lattices[n].v);
+		}
+	}
+	free(lattices);
+	free(hashes);
+	free(o);
+	free(rs.ring);
+	free(row);
+	free(base_row);
+	free(wide);
+	octave_plan_free(&plan);
+
+	return status;
+}
+
+/******************************************************************************/
+/* Animation. */
+
+/*
+Animated textures add a time axis to the lattices of the octaves. At frame t,
+an octave reads the blend of two planes, the lattices of the time nodes around
+t, with the spline of the octave along the time axis. Time cells are as many
+frames long as the spatial cells are pixels wide, so that every octave moves by
+about a pixel per frame; octaves whose step is below 2 use cells of 2 frames.
+
+Planes are hashed from the seed and their time node, and the seed of node 0 is
+the seed itself: frame 0 is the still texture of the hash generator. A plane is
+only computed when the frames enter a new time cell, and then only one since
+the top plane of a cell is the bottom plane of the previous one. Interpolation
+is linear in the nodes, so blending the nodes in time before interpolating them
+in space is the interpolation of the 3D lattice, up to one more rounding.
+*/
+typedef struct {
+	/* Blend of the planes, read by the octave. */
+	lattice blend;
+	/* Planes of the time nodes 'node' and 'node' + 1. */
+	Uint8 *plane1;
+	Uint8 *plane2;
+	unsigned int node;
+	int valid;
+	/* Spline along the time axis. */
+	spline s;
+} time_octave;
+
+typedef struct {
+	Uint16 octaves;
+	time_octave *o;
+	random_source *sources;
+	Uint32 seed;
+} time_lattice;
+
+void time_lattice_free(time_lattice *t) {
+	Uint16 n;
+	for (n = 0; n < t->octaves; n++) {
+		free(t->o[n].blend.v);
+		free(t->o[n].plane1);
+		free(t->o[n].plane2);
+		spline_free(&t->o[n].s);
+	}
+	free(t->o);
+	free(t->sources);
+}
+
+int time_lattice_init(time_lattice *t, const octave_plan *plan, tsize_t width,
+	tsize_t height, Uint32 seed) {
+	Uint16 n;
+
+	t->octaves = 0;
+	t->seed = seed;
+	t->o = malloc(plan->octaves * sizeof (time_octave));
+	t->sources = malloc(plan->octaves * sizeof (random_source));
+	if (!t->o || !t->sources) {
+		time_lattice_free(t);
+		trace("Allocation error.");
+		return EXIT_FAILURE;
+	}
+
+	for (n = 0; n < plan->octaves; n++) {
+		time_octave *o = &t->o[n];
+		tsize_t step = octave_step(width, height, plan->frequencies[n]);
+		if (lattice_init(&o->blend, width, height, step < 2 ? 1 : step, 0,
+				width, 0, height) == EXIT_FAILURE) {
+			time_lattice_free(t);
+			return EXIT_FAILURE;
+		}
+		o->plane1 = malloc(lattice_area(&o->blend));
+		o->plane2 = malloc(lattice_area(&o->blend));
+		o->valid = 0;
+		if (!o->plane1 || !o->plane2 ||
+			spline_init(&o->s, step < 2 ? 2 : step, plan->fixed_point) ==
+			EXIT_FAILURE) {
+			free(o->blend.v);
+			free(o->plane1);
+			free(o->plane2);
+			time_lattice_free(t);
+			trace("Allocation error.");
+			return EXIT_FAILURE;
+		}
+		t->octaves++;
+
+		random_source src = {
+			lattice_source_row, &o->blend, width, height, 0, 0
+		};
+		t->sources[n] = src;
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Nodes of the rows from 'first' to 'last' of the plane of time node 'node'. */
+void time_plane(Uint8 *dest, const lattice *l, Uint32 seed, unsigned int node,
+	tsize_t first, tsize_t last) {
+	Uint32 plane_seed = seed ^ hash32(node * HASH_GOLDEN);
+	tsize_t cols = l->col_last + 1;
+	tsize_t r, c;
+
+	for (r = first; r <= last; r++) {
+		Uint32 key = hash_key(plane_seed, lattice_coord(l->width, l->step, r));
+		Uint8 *row = dest + (tarea_t)r * cols;
+		for (c = 0; c < cols; c++) {
+			row[c] = hash32(lattice_coord(l->height, l->step, c) *
+				HASH_GOLDEN ^ key) >> 24;
+		}
+	}
+}
+
+typedef struct {
+	time_octave *o;
+	Uint32 seed;
+	/* Planes to compute before blending. */
+	int fill1;
+	int fill2;
+	tsize_t delta;
+	tsize_t band;
+} time_job;
+
+int time_band(void *data, unsigned long index) {
+	time_job *job = data;
+	time_octave *o = job->o;
+	tsize_t rows = o->blend.row_last + 1, cols = o->blend.col_last + 1;
+	tsize_t r;
+	tsize_t begin = index * job->band;
+	tsize_t end = rows - begin < job->band ? rows : begin + job->band;
+
+	if (job->fill1) {
+		time_plane(o->plane1, &o->blend, job->seed, o->node, begin, end - 1);
+	}
+	if (job->fill2) {
+		time_plane(o->plane2, &o->blend, job->seed, o->node + 1, begin,
+			end - 1);
+	}
+	for (r = begin; r < end; r++) {
+		tarea_t offset = (tarea_t)r * cols;
+		interpol_blend(o->blend.v + offset, o->plane1 + offset,
+			o->plane2 + offset, cols, &o->s, job->delta);
+	}
+	return EXIT_SUCCESS;
+}
+
+/* Blend the lattices of every octave at frame 'frame'. */
+int time_lattice_update(time_lattice *t, unsigned int frame,
+	const render_options *opt) {
+	Uint16 n;
+
+	for (n = 0; n < t->octaves; n++) {
+		time_octave *o = &t->o[n];
+		unsigned int node = frame / o->s.step;
+		time_job job = { o, t->seed, 0, 0, frame % o->s.step, 0 };
+
+		if (!o->valid || node != o->node) {
+			if (o->valid && node == o->node + 1) {
+				Uint8 *swap = o->plane1;
+				o->plane1 = o->plane2;
+				o->plane2 = swap;
+			} else {
+				job.fill1 = 1;
+			}
+			job.fill2 = 1;
+			o->node = node;
+			o->valid = 1;
+		}
+
+		tsize_t rows = o->blend.row_last + 1;
+		job.band = band_rows(rows, opt);
+		if (pool_run(opt->workers, band_count(rows, job.band), time_band,
+				&job) == EXIT_FAILURE) {
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+/*
+A frame is written while the next one is rendered: frames alternate between two
+slots, and the writer of a slot runs in its own thread with its own pool. It is
+joined before the next writer starts, so that the slot of the next frame is
+always free.
+*/
+typedef struct {
+	layer base;
+	layer smoothed;
+	int smooth;
+	pthread_t thread;
+	int running;
+	int status;
+	char prefix[FILENAME_MAX];
+	const color_param *colors;
+	render_options opt;
+} frame_slot;
+
+void *frame_write(void *data) {
+	frame_slot *f = data;
+	f->status = save_results(&f->base, RESULT_GS, RESULT_ALT, f->colors,
+		&f->opt);
+	if (f->smooth && save_results(&f->smoothed, RESULT_GS_SMOOTH,
+			RESULT_ALT_SMOOTH, f->colors, &f->opt) == EXIT_FAILURE) {
+		f->status = EXIT_FAILURE;
+	}
+	return NULL;
+}
+
+int frame_join(frame_slot *f) {
+	if (!f->running) {
+		return EXIT_SUCCESS;
+	}
+	pthread_join(f->thread, NULL);
+	f->running = 0;
+	return f->status;
+}
+
+int animate_render(texture_parameter *tparam, const render_options *opt) {
+	color_param colors;
+	color_param_init(&colors, tparam);
+	tarea_t pixels = (tarea_t)tparam->width * tparam->height;
+	int smooth = tparam->smoothing != 0 && (opt->outputs & RESULT_SMOOTH);
+	unsigned int frame, k;
+
+	if (pixels == 0) {
+		trace("Texture size cannot be zero.");
+		return EXIT_FAILURE;
+	}
+	if (tparam->persistence_den == 0) {
+		trace("Persistence denominator cannot be zero.");
+		return EXIT_FAILURE;
+	}
+	if (opt->noise != NOISE_VALUE) {
+		trace("Frames are only available with value noise.");
+		return EXIT_FAILURE;
+	}
+	/* Two frame slots of a base and a smoothed layer, and the temporary layer
+	 * of the Gaussian smoothing. */
+	if (opt->arena) {
+		layer_arena_reset(opt->arena, tparam->width, tparam->height,
+			2 * (1 + smooth) + (smooth && opt->gaussian_smoothing));
+	}
+
+	stage_begin(opt, "init", "Init.");
+	octave_plan plan;
+	if (octave_plan_init(&plan, tparam->frequency, tparam->octaves,
+			(double)tparam->persistence_num / tparam->persistence_den,
+			tparam->width, tparam->height, opt) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+
+	time_lattice lattices;
+	if (time_lattice_init(&lattices, &plan, tparam->width, tparam->height,
+			tparam->seed) == EXIT_FAILURE) {
+		octave_plan_free(&plan);
+		return EXIT_FAILURE;
+	}
+
+	int status = EXIT_SUCCESS;
+	frame_slot slots[2];
+	for (k = 0; k < 2; k++) {
+		frame_slot *f = &slots[k];
+		f->base.v = NULL;
+		f->smoothed.v = NULL;
+		f->smooth = smooth;
+		f->running = 0;
+		f->colors = &colors;
+		f->opt = *opt;
+		f->opt.prefix = f->prefix;
+		f->opt.stats = NULL;
+		f->opt.workers = k == 0 ? pool_create(pool_threads(opt->workers)) :
+			slots[0].opt.workers;
+		if (layer_acquire(&f->base, tparam->width, tparam->height, opt) ==
+			EXIT_FAILURE || (smooth && layer_acquire(&f->smoothed,
+				tparam->width, tparam->height, opt) == EXIT_FAILURE)) {
+			status = EXIT_FAILURE;
+		}
+	}
+	if (!slots[0].opt.workers) {
+		status = EXIT_FAILURE;
+	}
+	stage_end(opt, 0);
+
+	stage_begin(opt, "frames", "Frames.");
+	for (frame = 0; frame < opt->frames && status == EXIT_SUCCESS; frame++) {
+		frame_slot *f = &slots[frame % 2];
+		work_job job = {
+			&f->base, lattices.sources, band_rows(tparam->width, opt), &plan
+		};
+
+		if (time_lattice_update(&lattices, frame, opt) == EXIT_FAILURE ||
+			pool_run(opt->workers, band_count(tparam->width, job.band),
+				work_band, &job) == EXIT_FAILURE ||
+			(smooth && smooth_layer_into(&f->smoothed, tparam->smoothing,
+				&f->base, opt) == EXIT_FAILURE)) {
+			trace("Frame failed.");
+			status = EXIT_FAILURE;
+			break;
+		}
+
+		/* The previous writer is done with the other slot. */
+		if (frame_join(&slots[(frame + 1) % 2]) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+			break;
+		}
+		snprintf(f->prefix, sizeof f->prefix, "%s_%04u", opt->prefix, frame);
+		if (pthread_create(&f->thread, NULL, frame_write, f) != 0) {
+			trace("Could not start frame writer.");
+			status = EXIT_FAILURE;
+			break;
+		}
+		f->running = 1;
+	}
+	for (k = 0; k < 2; k++) {
+		if (frame_join(&slots[k]) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+		}
+	}
+	stage_end(opt, pixels * opt->frames);
+
+	/* Layers go back to the arena in reverse order. */
+	for (k = 2; k-- > 0;) {
+		layer_release(&slots[k].smoothed, opt);
+		layer_release(&slots[k].base, opt);
+	}
+	pool_destroy(slots[0].opt.workers);
+	time_lattice_free(&lattices);
+	octave_plan_free(&plan);
+	return status;
+}
+
+/******************************************************************************/
+
+void texture_details(texture_parameter *tparam) {
+	if (tparam == NULL) {
+		return;
+	}
+
+	fprintf(stderr, "{");
+	#define TEXTURE_PRINT(opt, fmt)  fprintf(stderr, "  " #opt ": %" fmt  "\n", opt);
+
+	/* TODO: use macros to print using PRIu ## type_size. */
+	TEXTURE_PRINT(tparam->width, PRIu32);
+	TEXTURE_PRINT(tparam->height, PRIu32);
+
+	TEXTURE_PRINT(tparam->seed, PRIu16);
+	TEXTURE_PRINT(tparam->octaves, PRIu16);
+	TEXTURE_PRINT(tparam->frequency, PRIu16);
+	TEXTURE_PRINT(tparam->persistence_num, PRIu8);
+	TEXTURE_PRINT(tparam->persistence_den, PRIu8);
+
+	TEXTURE_PRINT(tparam->threshold_red, PRIu8);
+	TEXTURE_PRINT(tparam->threshold_green, PRIu8);
+	TEXTURE_PRINT(tparam->threshold_blue, PRIu8);
+	TEXTURE_PRINT(tparam->color1.red, PRIu8);
+	TEXTURE_PRINT(tparam->color1.green, PRIu8);
+	TEXTURE_PRINT(tparam->color1.blue, PRIu8);
+	TEXTURE_PRINT(tparam->color2.red, PRIu8);
+	TEXTURE_PRINT(tparam->color2.green, PRIu8);
+	TEXTURE_PRINT(tparam->color2.blue, PRIu8);
+	TEXTURE_PRINT(tparam->color3.red, PRIu8);
+	TEXTURE_PRINT(tparam->color3.green, PRIu8);
+	TEXTURE_PRINT(tparam->color3.blue, PRIu8);
+
+	TEXTURE_PRINT(tparam->smoothing, PRIu8);
+
+	fprintf(stderr, "}");
+}
+
+/**
+ * First we make sure the file length is correct, then we make sure the sequence
+ * of READ_OPT does not go beyond the file length by testing against remmem.
+ */
+int read_opt(qstring *s, texture_parameter *tparam) {
+	if (s->length != TEXTURE_FILE_SIZE) {
+		return EXIT_FAILURE;
+	}
+
+	unsigned long remmem = TEXTURE_FILE_SIZE;
+	const char *buf = s->val;
+
+	/* This macro comes in very handy to read argument one after another. */
+	#define READ_OPT(opt) \
+		if (sizeof (opt) > remmem) { return EXIT_FAILURE; } \
+		memcpy(&(opt), buf, sizeof (opt)); \
+		remmem -= sizeof (opt); \
+		buf += sizeof (opt);
+
+	READ_OPT(tparam->width);
+	READ_OPT(tparam->height);
+	READ_OPT(tparam->seed);
+	READ_OPT(tparam->octaves);
+	READ_OPT(tparam->frequency);
+	READ_OPT(tparam->persistence_num);
+	READ_OPT(tparam->persistence_den);
+	READ_OPT(tparam->threshold_red);
+	READ_OPT(tparam->threshold_green);
+	READ_OPT(tparam->threshold_blue);
+	READ_OPT(tparam->color1.red);
+	READ_OPT(tparam->color1.green);
+	READ_OPT(tparam->color1.blue);
+	READ_OPT(tparam->color2.red);
+	READ_OPT(tparam->color2.green);
+	READ_OPT(tparam->color2.blue);
+	READ_OPT(tparam->color3.red);
+	READ_OPT(tparam->color3.green);
+	READ_OPT(tparam->color3.blue);
+	READ_OPT(tparam->smoothing);
+
+	/* buf[0] != '\0' should never happen. */
+	if (buf[0] != '\0' || remmem != 0) {
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+Cache keys of the layers: the parameters and the options each stage reads, and
+nothing else, so that a change of the colors keeps all the layers and a change
+of the smoothing keeps the work layer.
+*/
+#define KEY(key, v) (key) = cache_key((key), &(v), sizeof (v))
+
+Uint64 random_key(const texture_parameter *tparam, const render_options *opt) {
+	Uint64 key = CACHE_KEY_INIT;
+	const Uint8 version = CACHE_VERSION, stage = 'r';
+	KEY(key, version);
+	KEY(key, stage);
+	KEY(key, tparam->width);
+	KEY(key, tparam->height);
+	KEY(key, tparam->seed);
+	KEY(key, opt->rng);
+	return key;
+}
+
+Uint64 work_key(const texture_parameter *tparam, const render_options *opt) {
+	Uint64 key = random_key(tparam, opt);
+	const Uint8 stage = 'w';
+	KEY(key, stage);
+	KEY(key, tparam->octaves);
+	KEY(key, tparam->frequency);
+	KEY(key, tparam->persistence_num);
+	KEY(key, tparam->persistence_den);
+	KEY(key, opt->wide_accumulator);
+	KEY(key, opt->fixed_point);
+	KEY(key, opt->noise);
+	return key;
+}
+
+Uint64 smooth_key(const texture_parameter *tparam, const render_options *opt) {
+	Uint64 key = work_key(tparam, opt);
+	const Uint8 stage = 's';
+	KEY(key, stage);
+	KEY(key, tparam->smoothing);
+	KEY(key, opt->gaussian_smoothing);
+	return key;
+}
+
+/*
+Acquire 'l' and take the layer of 'key' from the cache of the options. Returns
+EXIT_FAILURE, with 'l' released, if it must be generated.
+*/
+int cache_fetch(Uint64 key, layer *l, tsize_t width, tsize_t height,
+	const render_options *opt) {
+	if (!opt->cache || layer_acquire(l, width, height, opt) == EXIT_FAILURE) {
+		return EXIT_FAILURE;
+	}
+	if (layer_cache_fetch(opt->cache, key, l) == EXIT_FAILURE) {
+		layer_release(l, opt);
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
+
+void cache_store(Uint64 key, const layer *l, const render_options *opt) {
+	if (opt->cache) {
+		layer_cache_store(opt->cache, key, l);
+	}
+}
+
+/* Generate all the output files for the texture. */
+int render(texture_parameter *tparam, const render_options *opt) {
+	color_param colors;
+	color_param_init(&colors, tparam);
+	tarea_t pixels = (tarea_t)tparam->width * tparam->height;
+
+	if (pixels == 0) {
+		trace("Texture size cannot be zero.");
+		return EXIT_FAILURE;
+	}
+	if (opt->arena) {
+		layer_arena_reset(opt->arena, tparam->width, tparam->height,
+			RENDER_LAYERS);
+	}
+
+#ifdef DEBUG
+	/* The octaves do not need the full random layer: it is only generated
+	 * here for its visualization. */
+	if (opt->outputs & RESULT_BIT(RESULT_RANDOM)) {
+		stage_begin(opt, "random", "Random layer.");
+		layer random_layer;
+		Uint64 key = random_key(tparam, opt);
+		int cached = cache_fetch(key, &random_layer, tparam->width,
+			tparam->height, opt) == EXIT_SUCCESS;
+		if (cached || generate_random_layer(&random_layer, tparam->width,
+				tparam->height, tparam->seed, opt) == EXIT_SUCCESS) {
+			if (!cached) {
+				cache_store(key, &random_layer, opt);
+			}
+			save_results(&random_layer, RESULT_RANDOM, RESULT_RANDOM, &colors,
+				opt);
+		}
+		layer_release(&random_layer, opt);
+		stage_end(opt, pixels);
+	}
+#endif
+
+	if (!(opt->outputs & ~RESULT_BIT(RESULT_RANDOM))) {
+		return EXIT_SUCCESS;
+	}
+
+	/* The base layer will contain our final result. */
+	layer base;
+	Uint64 key = work_key(tparam, opt);
+	if (cache_fetch(key, &base, tparam->width, tparam->height, opt) ==
+		EXIT_SUCCESS) {
+		stage_begin(opt, "work", "Work layer, cached.");
+		stage_end(opt, 0);
+	} else {
+		stage_begin(opt, "init", "Init.");
+
+		/* The base layer will be generated upon a random layer. */
+		if (layer_acquire(&base, tparam->width, tparam->height, opt) ==
+			EXIT_FAILURE) {
+			trace("Init layer failed.");
+			return EXIT_FAILURE;
+		}
+		stage_end(opt, 0);
+
+		/* Transform base using Perlin algorithm upon a randomly generated
+		 * layer. */
+		stage_begin(opt, "work", "Work layer.");
+		if (tparam->persistence_den == 0) {
+			layer_release(&base, opt);
+			trace("Persistence denominator cannot be zero.");
+			return EXIT_FAILURE;
+		}
+		if (generate_work_layer
+				(tparam->frequency, tparam->octaves,
+			(double)tparam->persistence_num / tparam->persistence_den,
+			tparam->seed, &base, opt) == EXIT_FAILURE) {
+			layer_release(&base, opt);
+			trace("Work layer failed.");
+			return EXIT_FAILURE;
+		}
+		stage_end(opt, pixels);
+		cache_store(key, &base, opt);
+	}
+
+	stage_begin(opt, "outputs", "Outputs.");
+	int status = save_results(&base, RESULT_GS, RESULT_ALT, &colors, opt);
+	stage_end(opt, pixels);
+
+	/* Smoothed version if option is non-zero and a smoothed output is
+	 * requested. */
+	if (tparam->smoothing != 0 && (opt->outputs & RESULT_SMOOTH)) {
+		layer layer_smoothed;
+		key = smooth_key(tparam, opt);
+		if (cache_fetch(key, &layer_smoothed, tparam->width, tparam->height,
+				opt) == EXIT_SUCCESS) {
+			stage_begin(opt, "smoothing", "Smoothing, cached.");
+			stage_end(opt, 0);
+		} else {
+			stage_begin(opt, "smoothing", "Smoothing.");
+			if (smooth_layer(&layer_smoothed, tparam->smoothing, &base, opt) ==
+				EXIT_FAILURE) {
+				layer_release(&base, opt);
+				trace("Smoothed layer failed.");
+				return EXIT_FAILURE;
+			}
+			stage_end(opt, pixels);
+			cache_store(key, &layer_smoothed, opt);
+		}
+
+		stage_begin(opt, "smoothed_outputs", "Smoothed outputs.");
+		if (save_results(&layer_smoothed, RESULT_GS_SMOOTH, RESULT_ALT_SMOOTH,
+				&colors, opt) == EXIT_FAILURE) {
+			status = EXIT_FAILURE;
+		}
+		stage_end(opt, pixels);
+
+		layer_release(&layer_smoothed, opt);
+	}
+
+	layer_release(&base, opt);
+	return status;
+}
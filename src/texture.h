@@ -0,0 +1,302 @@
+/*
+Copyright © 2013-2014 Pierre Neidhardt
+See LICENSE file for copyright and license details.
+*/
+
+#ifndef TEXTURE_H
+#define TEXTURE_H 1
+
+#include <stdint.h>
+
+#include "pool.h"
+
+/* Fixed-size integers, under the names of SDL which the engine used to read
+them from. */
+typedef uint8_t Uint8;
+typedef uint16_t Uint16;
+typedef uint32_t Uint32;
+typedef uint64_t Uint64;
+
+/* Typedef for pixel lengths, like texture resolution. We use typedefs to allow
+for customizable max size. */
+typedef Uint32 tsize_t;
+typedef Uint64 tarea_t;
+
+typedef struct {
+	Uint8 red;
+	Uint8 green;
+	Uint8 blue;
+} color;
+
+/* This is the sume of all parameter sizes. */
+#define TEXTURE_FILE_SIZE 29
+
+/**
+ * Texture parameters. Note that the persistence is given as two positive
+ * integers, the numerator and the denominator. The final persistence is
+ *
+ *   (double) persistence_num / (double) persistence_den
+ *
+ * Textures may be rectangular. The lattice cells of the octaves are square
+ * whatever the shape, see octave_step().
+ */
+/* TODO: decrease size of the seed? */
+typedef struct {
+	tsize_t width;
+	tsize_t height;
+	Uint16 seed;
+	Uint16 octaves;
+	Uint16 frequency;
+	Uint8 persistence_num;
+	Uint8 persistence_den;
+	Uint8 threshold_red;
+	Uint8 threshold_green;
+	Uint8 threshold_blue;
+	color color1;
+	color color2;
+	color color3;
+	Uint8 smoothing;
+} texture_parameter;
+
+/*
+Layer rows are columns of the picture: a layer has 'width' rows of 'height'
+values, and row i is the column x = i of the picture.
+*/
+typedef struct {
+	Uint8 *v;
+	tsize_t width;
+	tsize_t height;
+} layer;
+
+/*
+Layers are carved from an arena, a single reservation of memory reused by every
+render, see layer_acquire(). Its pages stay mapped from one texture to the
+next, so that a batch only faults them in once. With 'hugepages', the
+reservation is aligned and advised for transparent hugepages, which saves TLB
+misses on big layers.
+*/
+typedef struct {
+	Uint8 *base;
+	tarea_t reserved;
+	/* Bytes handed out, and bytes ever handed out since the reservation. */
+	tarea_t used;
+	tarea_t touched;
+	int hugepages;
+} layer_arena;
+
+/* Cache of the layers of the stages, see cache.h. */
+typedef struct layer_cache layer_cache;
+
+/* Random number generators for the random layer. */
+enum {
+	RNG_LIBC,
+	RNG_HASH
+};
+
+/* Noises of the octaves, see gradient. */
+enum {
+	NOISE_VALUE,
+	NOISE_PERLIN,
+	NOISE_SIMPLEX,
+	NOISE_COUNT
+};
+
+/* Output file formats, see output_driver. */
+enum {
+	FORMAT_BMP,
+	FORMAT_PNM,
+	FORMAT_RAW,
+	FORMAT_COUNT
+};
+
+/* Output files, in the order of the OUTPUT_* names. */
+enum {
+	RESULT_RANDOM,
+	RESULT_GS,
+	RESULT_RGB,
+	RESULT_ALT,
+	RESULT_GS_SMOOTH,
+	RESULT_RGB_SMOOTH,
+	RESULT_ALT_SMOOTH,
+	RESULT_COUNT
+};
+
+#define RESULT_BIT(r) (1u << (r))
+#define RESULT_SMOOTH (RESULT_BIT(RESULT_GS_SMOOTH) | \
+	RESULT_BIT(RESULT_RGB_SMOOTH) | RESULT_BIT(RESULT_ALT_SMOOTH))
+
+/* The random layer is only written by debug builds, see render(). */
+#ifdef DEBUG
+#define RESULT_DEFAULT (RESULT_BIT(RESULT_COUNT) - 1)
+#else
+#define RESULT_DEFAULT ((RESULT_BIT(RESULT_COUNT) - 1) & \
+	~RESULT_BIT(RESULT_RANDOM))
+#endif
+
+/* Window of the picture: 'x' and 'y' are its top-left corner. */
+typedef struct {
+	tsize_t x;
+	tsize_t y;
+	tsize_t width;
+	tsize_t height;
+} region;
+
+/* Output formats of the statistics of the stages. */
+enum {
+	STATS_TEXT,
+	STATS_JSON
+};
+
+/* Statistics of the current stage, see stage_begin(). */
+typedef struct {
+	/* One of the STATS_* values. */
+	int format;
+	/* Name of the texture in the JSON lines. */
+	const char *texture;
+	const char *stage;
+	/* Wall and CPU times at the start of the stage, in seconds. */
+	double wall;
+	double cpu;
+	/* Bytes of layers allocated since the start of the stage. */
+	tarea_t allocated;
+} render_stats;
+
+/* Rendering options, set from the command-line. */
+typedef struct {
+	/* One of the RNG_* values. */
+	int rng;
+	/* One of the NOISE_* values. */
+	int noise;
+	/* Sum the octaves on 32 bits instead of the 8-bit base layer. */
+	int wide_accumulator;
+	/* Q16 integer interpolation and accumulation, see octave_plan. */
+	int fixed_point;
+	/* Approximate a Gaussian instead of a box when smoothing. */
+	int gaussian_smoothing;
+	/* Worker threads. NULL means serial. */
+	pool *workers;
+	/* Render by bands within the memory budget, see stream_render(). */
+	int stream;
+	tarea_t max_memory;
+	/* Window to render in streaming mode, the whole picture if its width is
+	 * 0. */
+	region window;
+	/* One of the FORMAT_* values. */
+	int format;
+	/* Write the grayscale outputs as 8-bit paletted BMP files. */
+	int paletted_gray;
+	/* Frames of the animation, 0 for a still texture, see animate_render(). */
+	unsigned int frames;
+	/* Write the mipmap chain of every output, see save_mipmaps(). */
+	int mipmaps;
+	/* Output files to write, as RESULT_BIT() flags. */
+	unsigned int outputs;
+	/* Prepended to the output file names. */
+	const char *prefix;
+	/* Descriptors to write the outputs to, indexed by RESULT_*, instead of
+	 * files named after the prefix. NULL means files. */
+	const int *output_fds;
+	/* Arena of the layers. NULL means they are allocated on the heap. */
+	layer_arena *arena;
+	/* Cache of the random, work and smoothed layers. NULL means none. */
+	layer_cache *cache;
+	/* Statistics of the stages. NULL means none are measured. */
+	render_stats *stats;
+} render_options;
+
+/* Quick strings. Having length is time saving compared to strlen(). */
+typedef struct {
+	char *val;
+	unsigned long length;
+} qstring;
+
+typedef struct {
+	Uint8 threshold_red;
+	Uint8 threshold_green;
+	Uint8 threshold_blue;
+	color color1;
+	color color2;
+	color color3;
+} rgb_param;
+
+typedef struct {
+	Uint8 threshold;
+	color color1;
+	color color2;
+} alt_param;
+
+/* Colors of the texture, shared by all the outputs. */
+typedef struct {
+	rgb_param rgb;
+	alt_param alt;
+} color_param;
+
+/* Names of the outputs on the command-line, in the order of RESULT_*. */
+extern const char *result_keys[RESULT_COUNT];
+/* Names of the formats on the command-line, in the order of FORMAT_*. */
+extern const char *format_keys[FORMAT_COUNT];
+/* Names of the noises on the command-line, in the order of NOISE_*. */
+extern const char *noise_keys[NOISE_COUNT];
+
+/* File name of an output in 'buf', of length FILENAME_MAX. */
+int result_file(char *buf, unsigned int result, const render_options *opt);
+
+int qstring_init(qstring *s, unsigned long size);
+void qstring_free(qstring *s);
+
+void trace(const char *s);
+
+/*
+A stage of the rendering starts by tracing its description. With statistics, its
+end prints its wall and CPU times, the rate of its 'pixels', the bytes of layers
+it allocated and the peak RSS: in text on stderr, or as one JSON line on stdout.
+*/
+void stage_begin(const render_options *opt, const char *stage,
+	const char *description);
+void stage_end(const render_options *opt, tarea_t pixels);
+
+/* Layers held at once by render(): the base layer, the smoothed layer and the
+ * temporary layer of the smoothing. */
+#define RENDER_LAYERS 3
+
+/*
+Layers are taken from and given back to the arena of the options, if any, or
+the heap otherwise. An acquired layer is not cleared. layer_arena_reset()
+forgets all the layers of the arena, and reserves enough memory for 'layers'
+layers of the given size.
+*/
+
+int layer_acquire(layer *l, tsize_t width, tsize_t height,
+	const render_options *opt);
+void layer_release(layer *l, const render_options *opt);
+void layer_arena_init(layer_arena *a, int hugepages);
+void layer_arena_reset(layer_arena *a, tsize_t width, tsize_t height,
+	unsigned int layers);
+void layer_arena_free(layer_arena *a);
+
+/* Stages of the rendering. They run on the thread pool of the options. */
+int generate_random_layer(layer *random_layer, tsize_t width, tsize_t height,
+	Uint32 seed, const render_options *opt);
+int generate_work_layer(Uint16 frequency, Uint16 octaves, double persistence,
+	Uint32 seed, layer *current_layer, const render_options *opt);
+int smooth_layer(layer *smoothed_layer, tsize_t factor, layer *current_layer,
+	const render_options *opt);
+
+void color_param_init(color_param *c, const texture_parameter *tparam);
+int save_results(layer *current_layer, unsigned int first, unsigned int last,
+	const color_param *colors, const render_options *opt);
+
+/* Parse the content of a ptx file. */
+int read_opt(qstring *s, texture_parameter *tparam);
+void texture_details(texture_parameter *tparam);
+
+/* Generate all the output files for the texture, see stream_render() for the
+ * streaming mode. */
+int render(texture_parameter *tparam, const render_options *opt);
+int stream_render(texture_parameter *tparam, const render_options *opt);
+
+/* Render the frames of the animated texture, named after the prefix and the
+ * frame number, e.g. result_0007_RGB.bmp. */
+int animate_render(texture_parameter *tparam, const render_options *opt);
+
+#endif /* TEXTURE_H */
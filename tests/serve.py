@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""
+Client of 'ptg --serve', see src/serve.c for the protocol.
+
+  serve.py SOCKET PTX DIR
+
+Sends the descriptor PTX for the raw outputs of the command-line, once with the
+outputs on the socket and once as descriptors, and writes them in DIR/inline
+and DIR/fds under the names of ptg, while another client holds a partial
+request and a third one does not read its response. Then checks that a bad
+format and the random output are rejected on the same connection. Exits with 1
+on the first error.
+"""
+
+import os
+import socket
+import struct
+import sys
+import time
+
+REQUEST_SIZE = 35
+# Time the other clients may hold a request, well below the timeout of the
+# daemon.
+HELD = 1.0
+HEADER_SIZE = 64
+FORMAT_RAW = 2
+SERVE_FDS = 0x1
+
+# Names of the outputs, in the order of RESULT_*.
+NAMES = ["random", "GS", "RGB", "alt", "GS_smooth", "RGB_smooth", "alt_smooth"]
+
+
+def fail(message):
+    print("serve.py: " + message, file=sys.stderr)
+    sys.exit(1)
+
+
+def recv_full(sock, size):
+    data = b""
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            fail("connection closed")
+        data += chunk
+    return data
+
+
+def request(sock, descriptor, outputs, fmt, flags):
+    sock.sendall(descriptor + struct.pack("<IBB", outputs, fmt, flags))
+    fds = []
+    if flags & SERVE_FDS:
+        header, fds, _, _ = socket.recv_fds(sock, HEADER_SIZE, len(NAMES))
+        header += recv_full(sock, HEADER_SIZE - len(header))
+    else:
+        header = recv_full(sock, HEADER_SIZE)
+    status, mask = struct.unpack_from("<II", header)
+    sizes = struct.unpack_from("<%dQ" % len(NAMES), header, 8)
+    files = {}
+    for r, name in enumerate(NAMES):
+        if not mask & (1 << r):
+            continue
+        if flags & SERVE_FDS:
+            fd = fds.pop(0)
+            files[name] = os.pread(fd, sizes[r], 0)
+            os.close(fd)
+        else:
+            files[name] = recv_full(sock, sizes[r])
+    return status, files
+
+
+def save(files, directory):
+    os.makedirs(directory, exist_ok=True)
+    for name, data in files.items():
+        ext = "gray" if name.startswith("GS") else "rgb"
+        with open(os.path.join(directory, "result_%s.%s" % (name, ext)),
+                  "wb") as f:
+            f.write(data)
+
+
+def main():
+    if len(sys.argv) != 4:
+        fail("usage: serve.py SOCKET PTX DIR")
+    with open(sys.argv[2], "rb") as f:
+        descriptor = f.read()
+    if len(descriptor) != REQUEST_SIZE - 6:
+        fail("bad descriptor " + sys.argv[2])
+
+    idle = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    idle.connect(sys.argv[1])
+    idle.sendall(descriptor[:1])
+    stalled = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    stalled.connect(sys.argv[1])
+    stalled.sendall(descriptor + struct.pack("<IBB", 0, FORMAT_RAW, 0))
+
+    sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    sock.connect(sys.argv[1])
+    for flags, directory in ((0, "inline"), (SERVE_FDS, "fds")):
+        start = time.monotonic()
+        status, files = request(sock, descriptor, 0, FORMAT_RAW, flags)
+        if status != 0 or not files:
+            fail("request failed")
+        if time.monotonic() - start > HELD:
+            fail("request held by the other clients")
+        save(files, os.path.join(sys.argv[3], directory))
+
+    # Failures are answered with an empty reply and keep the connection.
+    for outputs, fmt in ((0, 3), (1, FORMAT_RAW)):
+        status, files = request(sock, descriptor, outputs, fmt, 0)
+        if status == 0 or files:
+            fail("request of format %d, outputs %d not rejected" %
+                 (fmt, outputs))
+    sock.close()
+    idle.close()
+    stalled.close()
+
+
+main()
@@ -4,6 +4,9 @@ res="$(realpath "$0")"
 res="${res%/*}/res"
 
 root=..
+ptg="$(realpath "$root"/src/ptg)"
+data="$(realpath "$root"/data)"
+tests="${res%/*}"
 
 sumcheck() {
 	output=$(sha1sum "$1" "$2" | cut -d' ' -f1)
@@ -18,6 +21,54 @@ sumcheck() {
 	fi
 }
 
+# Render all the textures of data/ into directory $1 with the options that
+# follow.
+render() {
+	dir=$1
+	shift
+	mkdir -p "$dir"
+	(cd "$dir" && "$ptg" "$@" "$data"/*.ptx >/dev/null 2>&1)
+}
+
+# Crop the window of $5x$6 pixels at $3,$4 out of the raw picture $1, which is
+# $2 pixels wide with $7 bytes per pixel.
+crop() {
+	row=$4
+	while [ "$row" -lt $(($4 + $6)) ]; do
+		tail -c +$(((row * $2 + $3) * $7 + 1)) "$1" | head -c $(($5 * $7))
+		row=$((row + 1))
+	done
+}
+
+# Check that every file of directory $2 is the same in directory $3. $1 names
+# the check.
+samecheck() {
+	failed=
+	for file in "$2"/*; do
+		if [ ! -f "$file" ] || ! cmp -s "$file" "$3/${file##*/}"; then
+			failed="$failed ${file##*/}"
+		fi
+	done
+	if [ -z "$failed" ]; then
+		echo "SUCCESS: $1"
+	else
+		echo "FAIL: $1:$failed"
+	fi
+}
+
+# Check the files of directory $2 against the sums of res/$1.sha1, and that
+# there are no others. The random layer is left out, as only some builds write
+# it.
+shacheck() {
+	rm -f "$2"/*_random.*
+	if (cd "$2" && sha1sum -c --status "$res/$1.sha1") &&
+		[ "$(ls "$2" | wc -l)" -eq "$(wc -l < "$res/$1.sha1")" ]; then
+		echo "SUCCESS: $1"
+	else
+		echo "FAIL: $1"
+	fi
+}
+
 "$root"/src/ptg "$root"/data/wood.ptx 2>/dev/null
 if [ $? -eq 0 ]; then
 	sumcheck "$res"/result_RGB.bmp result_RGB.bmp
@@ -25,3 +76,106 @@ if [ $? -eq 0 ]; then
 	sumcheck "$res"/result_alt_smooth.bmp result_alt_smooth.bmp
 	rm *bmp
 fi
+
+# Renders with other options must give the same files as the reference.
+tmp=$(mktemp -d)
+render "$tmp"/reference -j 1
+
+render "$tmp"/jobs -j 4
+samecheck "-j 4" "$tmp"/reference "$tmp"/jobs
+rm -rf "$tmp"/jobs
+
+render "$tmp"/stream --stream -m 20K
+samecheck "--stream -m 20K" "$tmp"/reference "$tmp"/stream
+rm -rf "$tmp"/stream
+
+# A window is the crop of the full picture.
+mkdir -p "$tmp"/full "$tmp"/window "$tmp"/crop
+(cd "$tmp"/full && "$ptg" -F raw "$data"/wood.ptx >/dev/null 2>&1)
+(cd "$tmp"/window &&
+	"$ptg" -F raw -R 40,30,64,48 "$data"/wood.ptx >/dev/null 2>&1)
+for file in "$tmp"/full/*; do
+	depth=3
+	case "$file" in
+	*.gray) depth=1 ;;
+	esac
+	crop "$file" 256 40 30 64 48 $depth > "$tmp"/crop/"${file##*/}"
+done
+samecheck "--region 40,30,64,48" "$tmp"/crop "$tmp"/window
+rm -rf "$tmp"/full "$tmp"/window "$tmp"/crop
+
+# The second run reads the layers the first one left in the cache.
+render "$tmp"/cold --cache="$tmp"/cache
+render "$tmp"/warm --cache="$tmp"/cache
+samecheck "--cache, cold" "$tmp"/reference "$tmp"/cold
+samecheck "--cache, warm" "$tmp"/reference "$tmp"/warm
+rm -rf "$tmp"/cold "$tmp"/warm "$tmp"/cache
+
+# Frame 0 is the still texture of the hash generator.
+render "$tmp"/hash -r hash
+render "$tmp"/frames -t 2
+mkdir -p "$tmp"/first
+for file in "$tmp"/frames/*_0000_*; do
+	name=${file##*/}
+	mv "$file" "$tmp"/first/"${name%%_0000_*}_${name#*_0000_}"
+done
+samecheck "--frames, frame 0" "$tmp"/hash "$tmp"/first
+rm -rf "$tmp"/hash "$tmp"/frames "$tmp"/first
+
+# Options which change the pixels are checked against sums of their outputs.
+render "$tmp"/gaussian -g
+shacheck gaussian "$tmp"/gaussian
+rm -rf "$tmp"/gaussian
+
+render "$tmp"/mipmaps -M
+shacheck mipmaps "$tmp"/mipmaps
+rm -rf "$tmp"/mipmaps
+
+# Fixed-point renders are the same on every compiler and architecture.
+render "$tmp"/fixed -f -r hash
+shacheck fixed "$tmp"/fixed
+rm -rf "$tmp"/fixed
+
+render "$tmp"/paletted -p
+shacheck paletted "$tmp"/paletted
+rm -rf "$tmp"/paletted
+
+# PNM files are the raw pixels after a header.
+render "$tmp"/raw -F raw
+render "$tmp"/pnm -F pnm
+mkdir -p "$tmp"/pixels
+for file in "$tmp"/pnm/*; do
+	name=${file##*/}
+	case "$name" in
+	*.pgm) name=${name%.pgm}.gray ;;
+	*.ppm) name=${name%.ppm}.rgb ;;
+	esac
+	size=$(wc -c < "$tmp"/raw/"$name")
+	tail -c "$size" "$file" > "$tmp"/pixels/"$name"
+done
+samecheck "--format pnm" "$tmp"/raw "$tmp"/pixels
+rm -rf "$tmp"/raw "$tmp"/pnm "$tmp"/pixels
+
+# The daemon sends the same raw files as a render of the command-line, on the
+# socket and as descriptors.
+mkdir -p "$tmp"/single
+(cd "$tmp"/single && "$ptg" -F raw "$data"/wood.ptx >/dev/null 2>&1)
+"$ptg" --serve "$tmp"/ptg.sock >/dev/null 2>&1 &
+pid=$!
+tries=0
+while [ ! -S "$tmp"/ptg.sock ] && [ "$tries" -lt 50 ]; do
+	sleep 0.1
+	tries=$((tries + 1))
+done
+if python3 "$tests"/serve.py "$tmp"/ptg.sock "$data"/wood.ptx \
+	"$tmp"/served; then
+	samecheck "--serve" "$tmp"/single "$tmp"/served/inline
+	samecheck "--serve, descriptors" "$tmp"/single "$tmp"/served/fds
+else
+	echo "FAIL: --serve"
+fi
+kill "$pid"
+wait "$pid"
+rm -rf "$tmp"/single "$tmp"/served
+
+rm -rf "$tmp"